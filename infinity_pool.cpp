@@ -2,16 +2,108 @@
 #include <vector>
 #include <unordered_map>
 #include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <map>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+
+#if defined(INFINITY_POOL_BENCH) && defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 // GLOBAL CONSTANTS
 const double SUPPLY = 1e15;  // maximum supply of pool shares
 const double FIRST = 1e8;   // amount of shares issued to first depositor
 
+#if defined(__GNUC__)
+#define INFINITY_POOL_PREFETCH(addr, rw) __builtin_prefetch((addr), (rw), 3)
+#else
+#define INFINITY_POOL_PREFETCH(addr, rw) ((void)0)
+#endif
+
+// the pool's full state, as returned by status()
+struct PoolStatus {
+    std::vector<std::string> tokens;
+    std::unordered_map<std::string, double> weights;
+    std::unordered_map<std::string, double> balances;
+    double shares_supply;
+    double shares_issued;
+    double invariant;
+};
+
+// heap and inline bytes held by one pool, by component
+struct PoolFootprint {
+    std::size_t object;
+    std::size_t tokens;
+    std::size_t weights;
+    std::size_t balances;
+
+    std::size_t total() const { return object + tokens + weights + balances; }
+};
+
+// partial derivatives of swap()'s amount out
+struct SwapSensitivity {
+    double amount_out;
+    double d_amount_in;
+    double d_balance_in;
+    double d_balance_out;
+    double d_weight_in;
+    double d_weight_out;
+};
+
+// partial derivatives of calculate_spot_price()
+struct SpotPriceSensitivity {
+    double price;
+    double d_balance_asset;
+    double d_balance_currency;
+    double d_weight_asset;
+    double d_weight_currency;
+};
+
+// partial derivatives of one token's withdrawal amount
+struct WithdrawSensitivity {
+    double amount_out;
+    double d_redeem;
+    double d_balance;
+    double d_weight;
+    double d_shares_issued;
+};
+
+// one LP exit for withdraw_batch(): withdraw_one(token, redeem), or
+// withdraw_all(redeem) when token is empty
+struct WithdrawRequest {
+    std::string token;
+    double redeem;
+};
+
 class InfinityPool {
 public:
     InfinityPool(const std::vector<std::string>& tokens);
 
-    std::unordered_map<std::string, double> status() const;
+    PoolStatus status() const;
 
     void initialize(const std::unordered_map<std::string, double>& amount_in);
 
@@ -25,24 +117,146 @@ public:
 
     double deposit_any(const std::unordered_map<std::string, double>& amount_in);
 
+    // Many proportional deposits at once, all validated against the current
+    // balances in one pass, applied as their sum with a single invariant
+    // update. Every accepted deposit gets shares in proportion to its first
+    // token amount as if the batch were one deposit; rejected ones give NaN.
+    // On an empty pool the first complete deposit sets the ratio, as
+    // deposit_all() would, and weights are not needed.
+    std::vector<double> deposit_batch(const std::vector<std::unordered_map<std::string, double>>& amount_in, double tolerance = 1e-6);
+
     std::unordered_map<std::string, double> withdraw_all(double redeem);
 
     double withdraw_one(const std::string& token, double redeem);
 
     std::unordered_map<std::string, double> withdraw_any(double redeem, const std::unordered_map<std::string, double>& ratios);
 
+    // Many withdraw_all/withdraw_one requests in one pass over the tokens.
+    // Each token pays out once, as a single withdrawal of the total redemption
+    // claiming it, split between the claimants pro rata, so no request's
+    // output depends on its position in the batch; one invariant update.
+    // Returns request-major rows in token order: tokens a request does not
+    // withdraw are 0, rejected requests are all NaN, like deposit_batch();
+    // nothing throws. A request is rejected if it is invalid on its own, if
+    // the pool has no weights yet, or if it would take the accepted
+    // redemptions past the shares issued, checked in request order. The pool
+    // and its version are left alone when nothing is accepted.
+    std::vector<double> withdraw_batch(const std::vector<WithdrawRequest>& requests);
+
     double swap(const std::string& t_in, const std::string& t_out, double amount_in);
 
+    // what swap() would return, without changing the pool
+    double quote_swap(const std::string& t_in, const std::string& t_out, double amount_in) const;
+
+    // quote_swap() for `count` input sizes at once, plus each size's price
+    // impact against the marginal rate; sizes swap() would reject give NaN
+    void quote_swap_curve(const std::string& t_in, const std::string& t_out, const double* amount_in, std::size_t count, double* amount_out,
+                          double* price_impact) const;
+
+    // closed-form derivatives of the current curve, with the same checks as
+    // the operations they differentiate
+    SwapSensitivity swap_sensitivity(const std::string& t_in, const std::string& t_out, double amount_in) const;
+
+    SpotPriceSensitivity spot_price_sensitivity(const std::string& asset, const std::string& currency) const;
+
+    WithdrawSensitivity withdraw_one_sensitivity(const std::string& token, double redeem) const;
+
+    std::unordered_map<std::string, WithdrawSensitivity> withdraw_all_sensitivity(double redeem) const;
+
     std::unordered_map<std::string, double> equalize(const std::unordered_map<std::string, double>& inputs, const std::unordered_map<std::string, double>& ratio_out);
 
+    // read-only views of the pool state
+    const std::vector<std::string>& get_tokens() const;
+
+    bool is_initialized() const;
+
+    double get_balance(const std::string& token) const;
+
+    double get_weight(const std::string& token) const;
+
+    double get_shares_issued() const;
+
+    double get_invariant() const;
+
+    // bumped by initialize() and every set_invariant(), which every change to
+    // an initialized pool ends with; lets caches tell whether a pool moved
+    std::uint64_t get_version() const;
+
+    PoolFootprint memory_footprint() const;
+
+    // rebuild the token table and maps with no spare capacity
+    void shrink_to_fit();
+
+    // compact, lossless encoding of the full pool state (no spare capacity, no maps)
+    std::string to_bytes() const;
+
+    static InfinityPool from_bytes(const std::string& bytes);
+
 private:
+    friend class PoolEngine;
+    friend class FlashTransaction;
+    friend class StripedPool;
+    friend class Mempool;
+
     std::vector<std::string> tokens;
     std::unordered_map<std::string, double> weights;
     std::unordered_map<std::string, double> balances;
     double shares_issued;
     double invariant;
 
+    // D when every weight is m_t / D for small integers m_t, else 0; set
+    // whenever weights are assigned and used to pick a swap kernel
+    std::uint32_t weight_denominator;
+
+    std::uint64_t version;
+
+    void classify_weights();
+
+    // Token-order pointers into `balances` and copies of the weights, built
+    // on first use once the pool is initialized, so per-token loops skip the
+    // string lookups. Map nodes never move or get erased after initialize(),
+    // which resets the row; copies start empty because the pointers belong
+    // to the source's maps, while moves keep it since the nodes move along.
+    // The moves are noexcept so vectors of pools move them on growth. The
+    // token hashes let a batch find a token's slot with no map probe.
+    struct TokenRow {
+        std::vector<double*> balance;
+        std::vector<double> weight;
+        std::vector<std::size_t> hash;
+
+        TokenRow() = default;
+        TokenRow(TokenRow&&) noexcept = default;
+        TokenRow& operator=(TokenRow&&) noexcept = default;
+        TokenRow(const TokenRow&) {}
+        TokenRow& operator=(const TokenRow&) {
+            balance.clear();
+            weight.clear();
+            hash.clear();
+            return *this;
+        }
+    };
+
+    TokenRow row;
+
+    // true once `row` is usable; false before weights are assigned
+    bool refresh_row();
+
     bool check_deposit_ratio(const std::unordered_map<std::string, double>& amount_in, double tolerance = 1e-9) const;
+
+    // which swap_output() kernel a pair takes: q == 0 is the generic
+    // expm1/log1p path, p == q the equal-weight one, otherwise r^(p/q);
+    // fixed by the weights, so callers quoting many sizes resolve it once
+    struct SwapKernel {
+        std::uint32_t p;
+        std::uint32_t q;
+        double e;
+    };
+
+    SwapKernel swap_kernel(double w_in, double w_out) const;
+
+    static double swap_output(const SwapKernel& kernel, double b_in, double b_out, double amount_in);
+
+    double swap_output(double b_in, double b_out, double w_in, double w_out, double amount_in) const;
 };
 
 InfinityPool::InfinityPool(const std::vector<std::string>& tokens) {
@@ -55,17 +269,12 @@ InfinityPool::InfinityPool(const std::vector<std::string>& tokens) {
     this->balances = {};
     this->shares_issued = 0.0;
     this->invariant = 0.0;
+    this->weight_denominator = 0;
+    this->version = 0;
 }
 
-std::unordered_map<std::string, double> InfinityPool::status() const {
-    return {
-        {"tokens", tokens},
-        {"weights", weights},
-        {"balances", balances},
-        {"shares_supply", SUPPLY},
-        {"shares_issued", shares_issued},
-        {"invariant", invariant},
-    };
+PoolStatus InfinityPool::status() const {
+    return {tokens, weights, balances, SUPPLY, shares_issued, invariant};
 }
 
 void InfinityPool::initialize(const std::unordered_map<std::string, double>& amount_in) {
@@ -78,6 +287,7 @@ void InfinityPool::initialize(const std::unordered_map<std::string, double>& amo
     }
 
     balances = amount_in;
+    row = TokenRow();
 
     for (const auto& token : tokens) {
         weights[token] = amount_in.at(token) / std::accumulate(amount_in.begin(), amount_in.end(), 0.0,
@@ -85,9 +295,69 @@ void InfinityPool::initialize(const std::unordered_map<std::string, double>& amo
     }
 
     shares_issued = FIRST;
+    classify_weights();
+    ++version;
+}
+
+// Calls kernel(std::integral_constant<std::size_t, N>()) for pools of 2, 3,
+// 4, 8 or 16 tokens and kernel(n) otherwise. The kernels loop over the dense
+// token row up to their argument, so for the fixed sizes the loop unrolls
+// and the independent pow() calls overlap; both paths do the same arithmetic
+// in the same order, so results are bit-identical.
+template <typename Kernel>
+static void with_size_class(std::size_t n, Kernel&& kernel) {
+    switch (n) {
+    case 2:
+        return kernel(std::integral_constant<std::size_t, 2>());
+    case 3:
+        return kernel(std::integral_constant<std::size_t, 3>());
+    case 4:
+        return kernel(std::integral_constant<std::size_t, 4>());
+    case 8:
+        return kernel(std::integral_constant<std::size_t, 8>());
+    case 16:
+        return kernel(std::integral_constant<std::size_t, 16>());
+    default:
+        return kernel(n);
+    }
+}
+
+bool InfinityPool::refresh_row() {
+    if (row.balance.size() == tokens.size()) {
+        return true;
+    }
+    if (weights.empty()) {
+        return false;
+    }
+    for (const auto& token : tokens) {
+        if (balances.find(token) == balances.end() || weights.find(token) == weights.end()) {
+            return false;
+        }
+    }
+    row.balance.clear();
+    row.weight.clear();
+    row.hash.clear();
+    for (const auto& token : tokens) {
+        row.balance.push_back(&balances.find(token)->second);
+        row.weight.push_back(weights.find(token)->second);
+        row.hash.push_back(std::hash<std::string>()(token));
+    }
+    return true;
 }
 
 double InfinityPool::set_invariant() {
+    ++version;
+    if (refresh_row()) {
+        with_size_class(tokens.size(), [this](auto count) {
+            double product = 1.0;
+            for (std::size_t t = 0; t < count; ++t) {
+                product *= std::pow(*row.balance[t], row.weight[t]);
+            }
+            invariant = product;
+        });
+        return invariant;
+    }
+
     invariant = 1.0;
     for (const auto& token : tokens) {
         invariant *= std::pow(balances[token], weights[token]);
@@ -134,19 +404,37 @@ double InfinityPool::deposit_all(const std::unordered_map<std::string, double>&
     }
 }
 
+// token by token, since the two maps need not iterate in the same order; an
+// empty pool accepts any ratio
 bool InfinityPool::check_deposit_ratio(const std::unordered_map<std::string, double>& amount_in, double tolerance) const {
-    std::vector<double> existing_ratio;
-    std::transform(balances.begin(), balances.end(), std::back_inserter(existing_ratio),
-                   [this](const auto& entry) { return entry.second / std::accumulate(balances.begin(), balances.end(), 0.0,
-                                                                                        [](double sum, const auto& balance) { return sum + balance.second; }); });
+    if (balances.empty()) {
+        return true;
+    }
+    if (amount_in.size() != balances.size()) {
+        return false;
+    }
 
-    std::vector<double> deposit_ratio;
-    std::transform(amount_in.begin(), amount_in.end(), std::back_inserter(deposit_ratio),
-                   [this](const auto& entry) { return entry.second / std::accumulate(amount_in.begin(), amount_in.end(), 0.0,
-                                                                                      [](double sum, const auto& balance) { return sum + balance.second; }); });
+    double balance_sum = std::accumulate(balances.begin(), balances.end(), 0.0, [](double sum, const auto& balance) { return sum + balance.second; });
+    double amount_sum = std::accumulate(amount_in.begin(), amount_in.end(), 0.0, [](double sum, const auto& amount) { return sum + amount.second; });
+    return std::all_of(balances.begin(), balances.end(), [&](const auto& balance) {
+        auto amount = amount_in.find(balance.first);
+        return amount != amount_in.end() && std::abs(balance.second / balance_sum - amount->second / amount_sum) < tolerance;
+    });
+}
 
-    return std::equal(existing_ratio.begin(), existing_ratio.end(), deposit_ratio.begin(),
-                      [tolerance](double a, double b) { return std::abs(a - b) < tolerance; });
+// check_deposit_ratio() over dense rows in token order, shared by the batch
+// paths: every amount positive and its share of the row within `tolerance`
+// of the balance's share of balance_sum; a NaN (missing token) fails
+static bool dense_deposit_ratio(const double* amount, const double* balance, double balance_sum, std::size_t k, double tolerance) {
+    double amount_sum = 0.0;
+    for (std::size_t t = 0; t < k; ++t) {
+        amount_sum += amount[t];
+    }
+    unsigned char ok = 1;
+    for (std::size_t t = 0; t < k; ++t) {
+        ok &= static_cast<unsigned char>((amount[t] > 0.0) & (std::abs(amount[t] / amount_sum - balance[t] / balance_sum) < tolerance));
+    }
+    return ok;
 }
 
 double InfinityPool::deposit_one(const std::unordered_map<std::string, double>& amount_in) {
@@ -188,6 +476,69 @@ double InfinityPool::deposit_any(const std::unordered_map<std::string, double>&
     return (amount_in.at(tokens[0]) * SUPPLY) / balances.at(tokens[0]);
 }
 
+std::vector<double> InfinityPool::deposit_batch(const std::vector<std::unordered_map<std::string, double>>& amount_in, double tolerance) {
+    const std::size_t n = amount_in.size();
+    const std::size_t k = tokens.size();
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+
+    // dense n x k rows in token order; a missing token reads as NaN and fails every comparison
+    std::vector<double> amount(n * k);
+    std::vector<double> balance(k);
+    for (std::size_t t = 0; t < k; ++t) {
+        auto b = balances.find(tokens[t]);
+        balance[t] = b != balances.end() ? b->second : nan;
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+        for (std::size_t t = 0; t < k; ++t) {
+            auto a = amount_in[i].find(tokens[t]);
+            amount[i * k + t] = a != amount_in[i].end() ? a->second : nan;
+        }
+    }
+
+    // an empty pool takes its first complete deposit as it comes, as
+    // deposit_all() does, and the rest of the batch must match that ratio
+    if (balances.empty()) {
+        for (std::size_t i = 0; i < n; ++i) {
+            const double* amounts = &amount[i * k];
+            if (amount_in[i].size() == k && std::all_of(amounts, amounts + k, [](double a) { return a > 0.0; })) {
+                std::copy(amounts, amounts + k, balance.begin());
+                break;
+            }
+        }
+    }
+    double balance_sum = std::accumulate(balance.begin(), balance.end(), 0.0);
+
+    std::vector<unsigned char> accept(n);
+    std::vector<double> total(k, 0.0);
+    for (std::size_t i = 0; i < n; ++i) {
+        const double* amounts = &amount[i * k];
+        bool ok = amount_in[i].size() == k && dense_deposit_ratio(amounts, balance.data(), balance_sum, k, tolerance);
+        accept[i] = ok;
+        for (std::size_t t = 0; t < k; ++t) {
+            total[t] += ok ? amounts[t] : 0.0;
+        }
+    }
+
+    std::vector<double> shares(n, nan);
+    if (total[0] == 0.0) {
+        return shares;
+    }
+    for (std::size_t t = 0; t < k; ++t) {
+        balances[tokens[t]] += total[t];
+    }
+    if (!weights.empty()) {
+        set_invariant();
+    }
+
+    const double per_unit = SUPPLY / balances.at(tokens[0]);
+    for (std::size_t i = 0; i < n; ++i) {
+        if (accept[i]) {
+            shares[i] = amount[i * k] * per_unit;
+        }
+    }
+    return shares;
+}
+
 std::unordered_map<std::string, double> InfinityPool::withdraw_all(double redeem) {
     if (redeem <= 0) {
         throw std::invalid_argument("Redeem amount must be positive.");
@@ -199,9 +550,19 @@ std::unordered_map<std::string, double> InfinityPool::withdraw_all(double redeem
     }
 
     std::unordered_map<std::string, double> amount_out;
-    for (const auto& token : tokens) {
-        amount_out[token] = balances[token] * (1.0 - std::pow(shares_issued - redeem_ratio, 1.0 / weights[token]));
-        balances[token] -= amount_out[token];
+    if (refresh_row()) {
+        with_size_class(tokens.size(), [&](auto count) {
+            for (std::size_t t = 0; t < count; ++t) {
+                double out = *row.balance[t] * (1.0 - std::pow(shares_issued - redeem_ratio, 1.0 / row.weight[t]));
+                *row.balance[t] -= out;
+                amount_out[tokens[t]] = out;
+            }
+        });
+    } else {
+        for (const auto& token : tokens) {
+            amount_out[token] = balances[token] * (1.0 - std::pow(shares_issued - redeem_ratio, 1.0 / weights[token]));
+            balances[token] -= amount_out[token];
+        }
     }
 
     shares_issued -= redeem_ratio;
@@ -260,6 +621,107 @@ std::unordered_map<std::string, double> InfinityPool::withdraw_any(double redeem
     return amount_out;
 }
 
+std::vector<double> InfinityPool::withdraw_batch(const std::vector<WithdrawRequest>& requests) {
+    const std::size_t n = requests.size();
+    const std::size_t k = tokens.size();
+    const std::size_t all = k;
+    const std::size_t rejected = k + 1;
+
+    std::unordered_map<std::string, std::size_t> index;
+    for (std::size_t t = 0; t < k; ++t) {
+        index[tokens[t]] = t;
+    }
+
+    // which token each request claims, and the redemption claiming each token
+    std::vector<std::size_t> column(n);
+    std::vector<double> claim(k, 0.0);
+    double claim_all = 0.0;
+    double total = 0.0;
+    for (std::size_t i = 0; i < n; ++i) {
+        double redeem_ratio = requests[i].redeem / SUPPLY;
+        auto t = requests[i].token.empty() ? index.end() : index.find(requests[i].token);
+        if (weights.empty() || requests[i].redeem <= 0 || total + redeem_ratio > shares_issued || (!requests[i].token.empty() && t == index.end())) {
+            column[i] = rejected;
+        } else if (t == index.end()) {
+            column[i] = all;
+            claim_all += redeem_ratio;
+            total += redeem_ratio;
+        } else {
+            column[i] = t->second;
+            claim[t->second] += redeem_ratio;
+            total += redeem_ratio;
+        }
+    }
+
+    std::vector<double> amount_out(n * k, 0.0);
+    if (total == 0.0) {
+        std::fill(amount_out.begin(), amount_out.end(), std::numeric_limits<double>::quiet_NaN());
+        return amount_out;
+    }
+
+    // what each token pays per unit of redemption claiming it
+    std::vector<double> per_unit(k, 0.0);
+    for (std::size_t t = 0; t < k; ++t) {
+        double redeem_ratio = claim_all + claim[t];
+        if (redeem_ratio == 0.0) {
+            continue;
+        }
+        double& balance = balances[tokens[t]];
+        double paid = balance * (1.0 - std::pow(shares_issued - redeem_ratio, 1.0 / weights[tokens[t]]));
+        balance -= paid;
+        per_unit[t] = paid / redeem_ratio;
+    }
+
+    shares_issued -= total;
+    set_invariant();
+
+    for (std::size_t i = 0; i < n; ++i) {
+        double* out = &amount_out[i * k];
+        double redeem_ratio = requests[i].redeem / SUPPLY;
+        if (column[i] == rejected) {
+            std::fill(out, out + k, std::numeric_limits<double>::quiet_NaN());
+        } else if (column[i] == all) {
+            for (std::size_t t = 0; t < k; ++t) {
+                out[t] = redeem_ratio * per_unit[t];
+            }
+        } else {
+            out[column[i]] = redeem_ratio * per_unit[column[i]];
+        }
+    }
+    return amount_out;
+}
+
+// 1 + s + ... + s^(n - 1) in O(log n) steps, from S(2m) = S(m) (1 + s^m) and
+// S(m + 1) = 1 + s S(m); every term is positive, so nothing cancels
+static double geometric_sum(double s, std::uint32_t n) {
+    double sum = 0.0;
+    double power = 1.0;
+    for (std::uint32_t bit = n ? 1u << (31 - __builtin_clz(n)) : 0; bit != 0; bit >>= 1) {
+        sum *= 1.0 + power;
+        power *= power;
+        if (n & bit) {
+            sum = 1.0 + s * sum;
+            power *= s;
+        }
+    }
+    return sum;
+}
+
+// 1 - r^(p/q) for r = 1 - x and q in {1, 2, 4}. With s = r^(1/q) from
+// hardware square roots, 1 - s^p = (1 - s) S(p) and x = (1 - s) S(q), so the
+// result is x S(p) / S(q) with no subtraction of near-equal values; cbrt()
+// and wider roots are no faster than the generic path and are left to it
+static double rational_complement(double x, std::uint32_t p, std::uint32_t q) {
+    double s = 1.0 - x;
+    if (q >= 2) {
+        s = std::sqrt(s);
+    }
+    if (q == 4) {
+        s = std::sqrt(s);
+    }
+    return x * geometric_sum(s, p) / geometric_sum(s, q);
+}
+
 double InfinityPool::swap(const std::string& t_in, const std::string& t_out, double amount_in) {
     if (weights.empty()) {
         throw std::invalid_argument("Swapping is not allowed until weights are assigned.");
@@ -273,7 +735,7 @@ double InfinityPool::swap(const std::string& t_in, const std::string& t_out, dou
         throw std::invalid_argument("Insufficient balance for the input token.");
     }
 
-    double amount_out = balances[t_out] * (1.0 - std::pow((balances[t_in] - amount_in) / balances[t_in], weights[t_in] / weights[t_out]));
+    double amount_out = swap_output(balances[t_in], balances[t_out], weights[t_in], weights[t_out], amount_in);
     balances[t_in] -= amount_in;
     balances[t_out] += amount_out;
 
@@ -281,33 +743,4773 @@ double InfinityPool::swap(const std::string& t_in, const std::string& t_out, dou
     return amount_out;
 }
 
-std::unordered_map<std::string, double> InfinityPool::equalize(const std::unordered_map<std::string, double>& inputs, const std::unordered_map<std::string, double>& ratio_out) {
+double InfinityPool::quote_swap(const std::string& t_in, const std::string& t_out, double amount_in) const {
     if (weights.empty()) {
-        throw std::invalid_argument("Equalizing is not allowed until weights are assigned.");
+        throw std::invalid_argument("Swapping is not allowed until weights are assigned.");
     }
 
-    if (!check_deposit_ratio(inputs, 1e-6) || !check_deposit_ratio(ratio_out, 1e-6)) {
-        throw std::invalid_argument("The input or output ratio does not match the existing token balances ratio.");
+    if (amount_in <= 0) {
+        throw std::invalid_argument("Amount in must be positive.");
     }
 
-    double total_weight_in = std::accumulate(weights.begin(), weights.end(), 0.0,
-        [this, &inputs](double acc, const auto& weight_entry) { return acc + weight_entry.second * inputs.at(weight_entry.first); });
+    auto b_in = balances.find(t_in);
+    auto b_out = balances.find(t_out);
+    if (b_in == balances.end() || b_out == balances.end()) {
+        throw std::invalid_argument("Invalid token indices.");
+    }
 
-    std::unordered_map<std::string, double> amount_out;
+    if (b_in->second < amount_in) {
+        throw std::invalid_argument("Insufficient balance for the input token.");
+    }
+
+    return swap_output(b_in->second, b_out->second, weights.at(t_in), weights.at(t_out), amount_in);
+}
+
+void InfinityPool::quote_swap_curve(const std::string& t_in, const std::string& t_out, const double* amount_in, std::size_t count,
+                                    double* amount_out, double* price_impact) const {
+    if (weights.empty()) {
+        throw std::invalid_argument("Swapping is not allowed until weights are assigned.");
+    }
+
+    auto b_in_it = balances.find(t_in);
+    auto b_out_it = balances.find(t_out);
+    if (b_in_it == balances.end() || b_out_it == balances.end()) {
+        throw std::invalid_argument("Invalid token indices.");
+    }
+
+    // everything pair-specific is hoisted, including the kernel swap() picks
+    // for this pair, so every size agrees with quote_swap() bit for bit and
+    // each kernel gets its own loop with no per-size dispatch. Only the
+    // equal-weight loop is plain arithmetic, and even that is vectorized only
+    // where NaN-raising compares may be if-converted (GCC needs
+    // -fno-trapping-math); the generic loop calls scalar expm1/log1p, the
+    // rational one sqrt and a short loop over the bits of p
+    const double b_in = b_in_it->second;
+    const double b_out = b_out_it->second;
+    const SwapKernel kernel = swap_kernel(weights.at(t_in), weights.at(t_out));
+    const double inv_marginal = b_in / (b_out * kernel.e);
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    auto curve = [&](auto complement) {
+        for (std::size_t i = 0; i < count; ++i) {
+            const double a = amount_in[i];
+            const bool valid = (a > 0.0) & (a <= b_in);
+            const double out = b_out * complement((valid ? a : 0.0) / b_in);
+            const double impact = 1.0 - out / a * inv_marginal;
+            amount_out[i] = valid ? out : nan;
+            price_impact[i] = valid ? impact : nan;
+        }
+    };
+    if (kernel.q == 0) {
+        curve([e = kernel.e](double x) { return -std::expm1(e * std::log1p(-x)); });
+    } else if (kernel.p == kernel.q) {
+        curve([](double x) { return x; });
+    } else {
+        curve([p = kernel.p, q = kernel.q](double x) { return rational_complement(x, p, q); });
+    }
+}
+
+// out = b_out * (1 - r^e) with r = (b_in - a) / b_in and e = w_in / w_out.
+// 1 - r^e comes from the kernel amount_out uses, so the two cannot disagree
+// for small a. Draining the input side (r == 0) is allowed, as in
+// quote_swap(), and gives the one-sided limits: the slope is infinite for
+// e < 1, and r^e log r goes to 0 so the weight terms vanish
+SwapSensitivity InfinityPool::swap_sensitivity(const std::string& t_in, const std::string& t_out, double amount_in) const {
+    double amount_out = quote_swap(t_in, t_out, amount_in);
+    double b_in = balances.at(t_in);
+    double b_out = balances.at(t_out);
+    double w_in = weights.at(t_in);
+    double w_out = weights.at(t_out);
+
+    SwapKernel kernel = swap_kernel(w_in, w_out);
+    double e = kernel.e;
+    double r = (b_in - amount_in) / b_in;
+    double r_e = std::pow(r, e);
+    double slope = b_out * e * std::pow(r, e - 1.0) / b_in;  // d out / d amount_in
+    double log_term = r > 0.0 ? b_out * r_e * std::log1p(-amount_in / b_in) : 0.0;
+    return {amount_out, slope, -slope * amount_in / b_in, swap_output(kernel, b_in, 1.0, amount_in), -log_term / w_out, log_term * w_in / (w_out * w_out)};
+}
+
+// p = (b_a / w_a) / (b_c / w_c)
+SpotPriceSensitivity InfinityPool::spot_price_sensitivity(const std::string& asset, const std::string& currency) const {
+    double price = calculate_spot_price(asset, currency);
+    return {price, price / balances.at(asset), -price / balances.at(currency), -price / weights.at(asset), price / weights.at(currency)};
+}
+
+// out = b * (1 - q^(1/w)) with q = shares_issued - redeem / SUPPLY
+WithdrawSensitivity InfinityPool::withdraw_one_sensitivity(const std::string& token, double redeem) const {
+    if (weights.empty()) {
+        throw std::invalid_argument("Single-asset withdrawal is not allowed until weights are assigned.");
+    }
+
+    if (redeem <= 0) {
+        throw std::invalid_argument("Redeem amount must be positive.");
+    }
+
+    double redeem_ratio = redeem / SUPPLY;
+    if (redeem_ratio > shares_issued) {
+        throw std::invalid_argument("Redeem amount exceeds the total shares issued.");
+    }
+
+    auto b = balances.find(token);
+    auto w = weights.find(token);
+    if (b == balances.end() || w == weights.end()) {
+        throw std::invalid_argument("Invalid token indices.");
+    }
+
+    double q = shares_issued - redeem_ratio;
+    double inverse = 1.0 / w->second;
+    double q_w = std::pow(q, inverse);
+    double d_q = b->second * inverse * std::pow(q, inverse - 1.0);  // -d out / d q
+    return {b->second * (1.0 - q_w), d_q / SUPPLY, 1.0 - q_w, b->second * q_w * std::log(q) * inverse * inverse, -d_q};
+}
+
+std::unordered_map<std::string, WithdrawSensitivity> InfinityPool::withdraw_all_sensitivity(double redeem) const {
+    std::unordered_map<std::string, WithdrawSensitivity> sensitivity;
     for (const auto& token : tokens) {
-        amount_out[token] = balances[token] * (std::pow(total_weight_in / weights[token], 1.0 / weights[token]) - 1.0);
-        balances[token] += inputs.at(token);
+        sensitivity[token] = withdraw_one_sensitivity(token, redeem);
     }
+    return sensitivity;
+}
 
-    set_invariant();
-    return amount_out;
+// largest denominator tried for pools that are not equal-weight
+static const std::uint32_t MAX_WEIGHT_DENOMINATOR = 64;
+
+void InfinityPool::classify_weights() {
+    weight_denominator = 0;
+    if (weights.empty()) {
+        return;
+    }
+
+    auto rational = [this](std::uint32_t d) {
+        return std::all_of(weights.begin(), weights.end(), [d](const auto& weight) {
+            double m = weight.second * d;
+            return m >= 0.5 && std::abs(m - std::round(m)) < 1e-12 * d;
+        });
+    };
+
+    // equal weights first, since a wide index pool needs D = token count
+    if (rational(static_cast<std::uint32_t>(tokens.size()))) {
+        weight_denominator = static_cast<std::uint32_t>(tokens.size());
+        return;
+    }
+    for (std::uint32_t d = 2; d <= MAX_WEIGHT_DENOMINATOR; ++d) {
+        if (rational(d)) {
+            weight_denominator = d;
+            return;
+        }
+    }
 }
 
-int main() {
-    std::vector<std::string> tokens = {"X", "Y", "Z"};
-    InfinityPool pool(tokens);
+InfinityPool::SwapKernel InfinityPool::swap_kernel(double w_in, double w_out) const {
+    SwapKernel kernel{0, 0, w_in / w_out};
+    if (weight_denominator != 0) {
+        auto p = static_cast<std::uint32_t>(std::lround(w_in * weight_denominator));
+        auto q = static_cast<std::uint32_t>(std::lround(w_out * weight_denominator));
+        std::uint32_t g = std::gcd(p, q);
+        p /= g;
+        q /= g;
+        if (p == q || q == 1 || q == 2 || q == 4) {
+            kernel.p = p;
+            kernel.q = q;
+        }
+    }
+    return kernel;
+}
 
-    // Example usage similar to the Python code...
+double InfinityPool::swap_output(const SwapKernel& kernel, double b_in, double b_out, double amount_in) {
+    if (kernel.q == 0) {
+        return -b_out * std::expm1(kernel.e * std::log1p(-amount_in / b_in));
+    }
+    // equal weights: 1 - r is exactly a / b_in
+    if (kernel.p == kernel.q) {
+        return b_out * (amount_in / b_in);
+    }
+    return b_out * rational_complement(amount_in / b_in, kernel.p, kernel.q);
+}
 
-    return 0;
+double InfinityPool::swap_output(double b_in, double b_out, double w_in, double w_out, double amount_in) const {
+    return swap_output(swap_kernel(w_in, w_out), b_in, b_out, amount_in);
+}
+
+const std::vector<std::string>& InfinityPool::get_tokens() const {
+    return tokens;
+}
+
+bool InfinityPool::is_initialized() const {
+    return !weights.empty();
+}
+
+std::uint64_t InfinityPool::get_version() const {
+    return version;
+}
+
+double InfinityPool::get_balance(const std::string& token) const {
+    auto it = balances.find(token);
+    if (it == balances.end()) {
+        throw std::invalid_argument("Invalid token " + token + ".");
+    }
+    return it->second;
+}
+
+double InfinityPool::get_weight(const std::string& token) const {
+    auto it = weights.find(token);
+    if (it == weights.end()) {
+        throw std::invalid_argument("Invalid token " + token + ".");
+    }
+    return it->second;
+}
+
+double InfinityPool::get_shares_issued() const {
+    return shares_issued;
+}
+
+double InfinityPool::get_invariant() const {
+    return invariant;
+}
+
+static std::size_t string_heap_bytes(const std::string& s) {
+    return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+
+// estimate for node-based maps: one allocation per element holding the next
+// pointer, the value and the cached hash, plus the bucket array
+static std::size_t map_heap_bytes(const std::unordered_map<std::string, double>& map) {
+    using node = std::unordered_map<std::string, double>::value_type;
+    std::size_t bytes = map.bucket_count() > 1 ? map.bucket_count() * sizeof(void*) : 0;
+    for (const auto& entry : map) {
+        bytes += sizeof(void*) + sizeof(node) + sizeof(std::size_t) + string_heap_bytes(entry.first);
+    }
+    return bytes;
+}
+
+PoolFootprint InfinityPool::memory_footprint() const {
+    // the token table, including its dense balance/weight row
+    std::size_t token_bytes = tokens.capacity() * sizeof(std::string) + row.balance.capacity() * sizeof(double*) + row.weight.capacity() * sizeof(double) +
+                              row.hash.capacity() * sizeof(std::size_t);
+    for (const auto& token : tokens) {
+        token_bytes += string_heap_bytes(token);
+    }
+    return {sizeof(InfinityPool), token_bytes, map_heap_bytes(weights), map_heap_bytes(balances)};
+}
+
+void InfinityPool::shrink_to_fit() {
+    tokens.shrink_to_fit();
+    for (auto& token : tokens) {
+        token.shrink_to_fit();
+    }
+    weights.rehash(0);
+    balances.rehash(0);
+    row.balance.shrink_to_fit();
+    row.weight.shrink_to_fit();
+    row.hash.shrink_to_fit();
+}
+
+static void put_varint(std::string& out, std::size_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static std::size_t get_varint(const std::string& in, std::size_t& pos) {
+    std::size_t value = 0;
+    for (int shift = 0; pos < in.size(); shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(in[pos++]);
+        value |= static_cast<std::size_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw std::invalid_argument("Truncated pool encoding.");
+}
+
+static void put_double(std::string& out, double value) {
+    char raw[sizeof(double)];
+    std::memcpy(raw, &value, sizeof(double));
+    out.append(raw, sizeof(double));
+}
+
+static double get_double(const std::string& in, std::size_t& pos) {
+    if (pos + sizeof(double) > in.size()) {
+        throw std::invalid_argument("Truncated pool encoding.");
+    }
+    double value;
+    std::memcpy(&value, in.data() + pos, sizeof(double));
+    pos += sizeof(double);
+    return value;
+}
+
+// layout: token count, then per token its name, balance and (if assigned)
+// weight in token order, then shares issued, invariant and version; the
+// version travels with the state so a cold round trip never reuses one
+std::string InfinityPool::to_bytes() const {
+    std::string out;
+    put_varint(out, tokens.size());
+    out.push_back(static_cast<char>(!weights.empty()));
+    for (const auto& token : tokens) {
+        put_varint(out, token.size());
+        out.append(token);
+        auto b = balances.find(token);
+        put_double(out, b != balances.end() ? b->second : 0.0);
+        if (!weights.empty()) {
+            put_double(out, weights.at(token));
+        }
+    }
+    put_double(out, shares_issued);
+    put_double(out, invariant);
+    put_varint(out, static_cast<std::size_t>(version));
+    out.shrink_to_fit();
+    return out;
 }
+
+InfinityPool InfinityPool::from_bytes(const std::string& bytes) {
+    std::size_t pos = 0;
+    std::size_t count = get_varint(bytes, pos);
+    if (pos >= bytes.size()) {
+        throw std::invalid_argument("Truncated pool encoding.");
+    }
+    bool weighted = bytes[pos++] != 0;
+
+    std::vector<std::string> names;
+    std::vector<double> b(count);
+    std::vector<double> w(count);
+    names.reserve(count);
+    for (std::size_t t = 0; t < count; ++t) {
+        std::size_t length = get_varint(bytes, pos);
+        if (pos + length > bytes.size()) {
+            throw std::invalid_argument("Truncated pool encoding.");
+        }
+        names.emplace_back(bytes, pos, length);
+        pos += length;
+        b[t] = get_double(bytes, pos);
+        w[t] = weighted ? get_double(bytes, pos) : 0.0;
+    }
+
+    InfinityPool pool(names);
+    pool.balances.reserve(count);
+    if (weighted) {
+        pool.weights.reserve(count);
+    }
+    for (std::size_t t = 0; t < count; ++t) {
+        if (b[t] != 0.0 || weighted) {
+            pool.balances[names[t]] = b[t];
+        }
+        if (weighted) {
+            pool.weights[names[t]] = w[t];
+        }
+    }
+    pool.shares_issued = get_double(bytes, pos);
+    pool.invariant = get_double(bytes, pos);
+    pool.version = get_varint(bytes, pos);
+    pool.classify_weights();
+    return pool;
+}
+
+std::unordered_map<std::string, double> InfinityPool::equalize(const std::unordered_map<std::string, double>& inputs, const std::unordered_map<std::string, double>& ratio_out) {
+    if (weights.empty()) {
+        throw std::invalid_argument("Equalizing is not allowed until weights are assigned.");
+    }
+
+    if (!check_deposit_ratio(inputs, 1e-6) || !check_deposit_ratio(ratio_out, 1e-6)) {
+        throw std::invalid_argument("The input or output ratio does not match the existing token balances ratio.");
+    }
+
+    double total_weight_in = std::accumulate(weights.begin(), weights.end(), 0.0,
+        [this, &inputs](double acc, const auto& weight_entry) { return acc + weight_entry.second * inputs.at(weight_entry.first); });
+
+    std::unordered_map<std::string, double> amount_out;
+    if (refresh_row()) {
+        with_size_class(tokens.size(), [&](auto count) {
+            for (std::size_t t = 0; t < count; ++t) {
+                double out = *row.balance[t] * (std::pow(total_weight_in / row.weight[t], 1.0 / row.weight[t]) - 1.0);
+                *row.balance[t] += inputs.at(tokens[t]);
+                amount_out[tokens[t]] = out;
+            }
+        });
+    } else {
+        for (const auto& token : tokens) {
+            amount_out[token] = balances[token] * (std::pow(total_weight_in / weights[token], 1.0 / weights[token]) - 1.0);
+            balances[token] += inputs.at(token);
+        }
+    }
+
+    set_invariant();
+    return amount_out;
+}
+
+// TOKEN INDEX
+
+static std::size_t bitmap_popcount(std::uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<std::size_t>(__builtin_popcountll(word));
+#else
+    std::size_t count = 0;
+    for (; word != 0; word &= word - 1) {
+        ++count;
+    }
+    return count;
+#endif
+}
+
+static unsigned bitmap_ctz(std::uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<unsigned>(__builtin_ctzll(word));
+#else
+    unsigned bit = 0;
+    for (; (word & 1) == 0; word >>= 1) {
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+// Set of pool ids, roaring style: an id is split into a 16-bit key and a
+// 16-bit low part, and each key's low parts are kept as a sorted array
+// while there are at most ARRAY_LIMIT of them, as a 65536-bit bitmap
+// beyond that. Sparse sets cost 2 bytes per id, dense ones 1 bit.
+class PoolBitmap {
+public:
+    void add(std::uint32_t id);
+
+    bool contains(std::uint32_t id) const;
+
+    std::size_t size() const;
+
+    // ascending
+    std::vector<std::size_t> ids() const;
+
+    PoolBitmap operator&(const PoolBitmap& other) const;
+
+    PoolBitmap& operator|=(const PoolBitmap& other);
+
+    std::size_t memory_bytes() const;
+
+private:
+    static const std::size_t ARRAY_LIMIT = 4096;
+    static const std::size_t WORDS = 1024;
+
+    struct Container {
+        std::uint16_t key = 0;
+        std::size_t cardinality = 0;
+        std::vector<std::uint16_t> array;  // sorted low parts while bits is empty
+        std::vector<std::uint64_t> bits;   // WORDS words once the array is outgrown
+    };
+
+    std::vector<Container> containers;  // sorted by key
+
+    static void to_bits(Container& c);
+
+    static void to_array(Container& c);
+
+    static Container intersect(const Container& a, const Container& b);
+
+    static void unite(Container& a, const Container& b);
+};
+
+void PoolBitmap::to_bits(Container& c) {
+    c.bits.assign(WORDS, 0);
+    for (std::uint16_t low : c.array) {
+        c.bits[low >> 6] |= std::uint64_t(1) << (low & 63);
+    }
+    std::vector<std::uint16_t>().swap(c.array);
+}
+
+void PoolBitmap::to_array(Container& c) {
+    c.array.clear();
+    c.array.reserve(c.cardinality);
+    for (std::size_t w = 0; w < WORDS; ++w) {
+        for (std::uint64_t word = c.bits[w]; word != 0; word &= word - 1) {
+            c.array.push_back(static_cast<std::uint16_t>(w * 64 + bitmap_ctz(word)));
+        }
+    }
+    std::vector<std::uint64_t>().swap(c.bits);
+}
+
+void PoolBitmap::add(std::uint32_t id) {
+    const auto key = static_cast<std::uint16_t>(id >> 16);
+    const auto low = static_cast<std::uint16_t>(id & 0xFFFF);
+    auto c = std::lower_bound(containers.begin(), containers.end(), key, [](const Container& c, std::uint16_t k) { return c.key < k; });
+    if (c == containers.end() || c->key != key) {
+        c = containers.insert(c, Container());
+        c->key = key;
+    }
+
+    if (!c->bits.empty()) {
+        std::uint64_t& word = c->bits[low >> 6];
+        const std::uint64_t bit = std::uint64_t(1) << (low & 63);
+        c->cardinality += (word & bit) == 0;
+        word |= bit;
+        return;
+    }
+    auto at = std::lower_bound(c->array.begin(), c->array.end(), low);
+    if (at != c->array.end() && *at == low) {
+        return;
+    }
+    c->array.insert(at, low);
+    if (++c->cardinality > ARRAY_LIMIT) {
+        to_bits(*c);
+    }
+}
+
+bool PoolBitmap::contains(std::uint32_t id) const {
+    const auto key = static_cast<std::uint16_t>(id >> 16);
+    const auto low = static_cast<std::uint16_t>(id & 0xFFFF);
+    auto c = std::lower_bound(containers.begin(), containers.end(), key, [](const Container& c, std::uint16_t k) { return c.key < k; });
+    if (c == containers.end() || c->key != key) {
+        return false;
+    }
+    if (!c->bits.empty()) {
+        return (c->bits[low >> 6] >> (low & 63)) & 1;
+    }
+    return std::binary_search(c->array.begin(), c->array.end(), low);
+}
+
+std::size_t PoolBitmap::size() const {
+    std::size_t total = 0;
+    for (const auto& c : containers) {
+        total += c.cardinality;
+    }
+    return total;
+}
+
+std::vector<std::size_t> PoolBitmap::ids() const {
+    std::vector<std::size_t> out;
+    out.reserve(size());
+    for (const auto& c : containers) {
+        const std::size_t high = static_cast<std::size_t>(c.key) << 16;
+        if (c.bits.empty()) {
+            for (std::uint16_t low : c.array) {
+                out.push_back(high | low);
+            }
+            continue;
+        }
+        for (std::size_t w = 0; w < WORDS; ++w) {
+            for (std::uint64_t word = c.bits[w]; word != 0; word &= word - 1) {
+                out.push_back(high | (w * 64 + bitmap_ctz(word)));
+            }
+        }
+    }
+    return out;
+}
+
+PoolBitmap::Container PoolBitmap::intersect(const Container& a, const Container& b) {
+    Container out;
+    out.key = a.key;
+    if (!a.bits.empty() && !b.bits.empty()) {
+        out.bits.resize(WORDS);
+        for (std::size_t w = 0; w < WORDS; ++w) {
+            out.bits[w] = a.bits[w] & b.bits[w];
+            out.cardinality += bitmap_popcount(out.bits[w]);
+        }
+        if (out.cardinality <= ARRAY_LIMIT) {
+            to_array(out);
+        }
+        return out;
+    }
+    if (a.bits.empty() && b.bits.empty()) {
+        std::set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), std::back_inserter(out.array));
+    } else {
+        const Container& sparse = a.bits.empty() ? a : b;
+        const Container& dense = a.bits.empty() ? b : a;
+        for (std::uint16_t low : sparse.array) {
+            if ((dense.bits[low >> 6] >> (low & 63)) & 1) {
+                out.array.push_back(low);
+            }
+        }
+    }
+    out.cardinality = out.array.size();
+    return out;
+}
+
+void PoolBitmap::unite(Container& a, const Container& b) {
+    if (a.bits.empty() && b.bits.empty() && a.cardinality + b.cardinality <= ARRAY_LIMIT) {
+        std::vector<std::uint16_t> merged;
+        merged.reserve(a.cardinality + b.cardinality);
+        std::set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(), std::back_inserter(merged));
+        a.array.swap(merged);
+        a.cardinality = a.array.size();
+        return;
+    }
+    if (a.bits.empty()) {
+        to_bits(a);
+    }
+    a.cardinality = 0;
+    for (std::size_t w = 0; w < WORDS; ++w) {
+        if (!b.bits.empty()) {
+            a.bits[w] |= b.bits[w];
+        }
+    }
+    for (std::uint16_t low : b.array) {
+        a.bits[low >> 6] |= std::uint64_t(1) << (low & 63);
+    }
+    for (std::size_t w = 0; w < WORDS; ++w) {
+        a.cardinality += bitmap_popcount(a.bits[w]);
+    }
+    if (a.cardinality <= ARRAY_LIMIT) {
+        to_array(a);
+    }
+}
+
+PoolBitmap PoolBitmap::operator&(const PoolBitmap& other) const {
+    PoolBitmap out;
+    auto a = containers.begin();
+    auto b = other.containers.begin();
+    while (a != containers.end() && b != other.containers.end()) {
+        if (a->key < b->key) {
+            ++a;
+        } else if (b->key < a->key) {
+            ++b;
+        } else {
+            Container c = intersect(*a++, *b++);
+            if (c.cardinality != 0) {
+                out.containers.push_back(std::move(c));
+            }
+        }
+    }
+    return out;
+}
+
+PoolBitmap& PoolBitmap::operator|=(const PoolBitmap& other) {
+    for (const auto& c : other.containers) {
+        auto at = std::lower_bound(containers.begin(), containers.end(), c.key, [](const Container& x, std::uint16_t k) { return x.key < k; });
+        if (at == containers.end() || at->key != c.key) {
+            containers.insert(at, c);
+        } else {
+            unite(*at, c);
+        }
+    }
+    return *this;
+}
+
+std::size_t PoolBitmap::memory_bytes() const {
+    std::size_t bytes = containers.capacity() * sizeof(Container);
+    for (const auto& c : containers) {
+        bytes += c.array.capacity() * sizeof(std::uint16_t) + c.bits.capacity() * sizeof(std::uint64_t);
+    }
+    return bytes;
+}
+
+// Pools holding each token, so that routing and pricing look up candidate
+// pools instead of scanning every pool's token list.
+class TokenIndex {
+public:
+    void add_pool(std::size_t id, const std::vector<std::string>& tokens);
+
+    // an empty set for tokens no pool holds
+    const PoolBitmap& pools_with(const std::string& token) const;
+
+    // ascending ids of the pools holding both tokens
+    std::vector<std::size_t> pools_with(const std::string& a, const std::string& b) const;
+
+    std::size_t memory_bytes() const;
+
+private:
+    std::unordered_map<std::string, PoolBitmap> bitmaps;
+    PoolBitmap none;
+};
+
+void TokenIndex::add_pool(std::size_t id, const std::vector<std::string>& tokens) {
+    if (id > std::numeric_limits<std::uint32_t>::max()) {
+        throw std::out_of_range("The token index holds at most 2^32 pools.");
+    }
+    for (const auto& token : tokens) {
+        bitmaps[token].add(static_cast<std::uint32_t>(id));
+    }
+}
+
+const PoolBitmap& TokenIndex::pools_with(const std::string& token) const {
+    auto it = bitmaps.find(token);
+    return it != bitmaps.end() ? it->second : none;
+}
+
+std::vector<std::size_t> TokenIndex::pools_with(const std::string& a, const std::string& b) const {
+    return (pools_with(a) & pools_with(b)).ids();
+}
+
+// same node estimate as map_heap_bytes(), plus the bitmaps' own storage
+std::size_t TokenIndex::memory_bytes() const {
+    using node = std::unordered_map<std::string, PoolBitmap>::value_type;
+    std::size_t bytes = bitmaps.bucket_count() > 1 ? bitmaps.bucket_count() * sizeof(void*) : 0;
+    for (const auto& entry : bitmaps) {
+        bytes += sizeof(void*) + sizeof(node) + sizeof(std::size_t) + string_heap_bytes(entry.first) + entry.second.memory_bytes();
+    }
+    return bytes;
+}
+
+// POOL ENGINE
+
+struct SwapOp {
+    std::size_t pool;
+    std::string t_in;
+    std::string t_out;
+    double amount_in;
+};
+
+struct DepositOp {
+    std::size_t pool;
+    std::unordered_map<std::string, double> amount_in;
+};
+
+struct EngineFootprint {
+    std::size_t pools;       // sum of every PoolFootprint
+    std::size_t pool_table;  // unused pool slots, activity tracking and the token index
+    std::size_t scratch;     // batch validation buffers
+
+    std::size_t total() const { return pools + pool_table + scratch; }
+};
+
+class PoolEngine {
+public:
+    std::size_t add_pool(const std::vector<std::string>& tokens);
+
+    InfinityPool& pool(std::size_t id);
+
+    const InfinityPool& pool(std::size_t id) const;
+
+    std::size_t size() const;
+
+    // which pools hold each token; pool token lists never change, so it is
+    // maintained by add_pool() alone
+    const TokenIndex& token_index() const;
+
+    std::vector<double> execute_swaps(const std::vector<SwapOp>& ops);
+
+    std::vector<double> execute_swaps_prefetched(const std::vector<SwapOp>& ops);
+
+    // accept masks (1 = valid against the current state), computed without
+    // throwing so that spam never reaches the execute stage
+    std::vector<unsigned char> validate_swaps(const std::vector<SwapOp>& ops);
+
+    std::vector<unsigned char> validate_deposits(const std::vector<DepositOp>& ops, double tolerance = 1e-6);
+
+    // rejected ops yield NaN instead of an exception
+    std::vector<double> execute_validated_swaps(const std::vector<SwapOp>& ops);
+
+    std::vector<double> execute_validated_deposits(const std::vector<DepositOp>& ops);
+
+    // Runs a block of swaps grouped by pool, keeping submission order within
+    // each pool. Ops on different pools commute, so the final state equals
+    // running the accepted ops in submission order; each touched pool's
+    // invariant is recomputed once, after its last op. Results are in op
+    // order, with NaN for ops that are invalid against the state they run on.
+    std::vector<double> execute_block(const std::vector<SwapOp>& ops);
+
+    EngineFootprint memory_footprint() const;
+
+    // Rebuild each pool in place, in id order, so its map nodes sit densely
+    // in memory, shrink every pool untouched for idle_batches batches and drop
+    // the validation scratch. Returns the number of bytes reclaimed.
+    std::size_t compact(std::uint64_t idle_batches = 1);
+
+private:
+    // Ops run through three stages this many ops apart: the pool object is
+    // prefetched, then its token row, then the op's tokens are found in the
+    // row by hash and their balance nodes and names are prefetched. No stage
+    // waits on memory an earlier stage has not already requested.
+    static constexpr std::size_t PREFETCH_DISTANCE = 8;
+
+    struct ResolvedSwap {
+        double* b_in;
+        double* b_out;
+        const double* w_in;
+        const double* w_out;
+        std::size_t t_in;
+        std::size_t t_out;
+    };
+
+    std::vector<InfinityPool> pools;
+    TokenIndex index;
+
+    // batch counter at each pool's last use, for compaction
+    std::vector<std::uint64_t> last_used;
+    std::uint64_t batch_clock = 0;
+
+    // validation scratch, reused across batches
+    std::vector<double> scratch_amount;
+    std::vector<double> scratch_balance;
+    std::vector<unsigned char> scratch_ready;
+    std::vector<std::size_t> scratch_order;
+    std::vector<std::size_t> scratch_offset;
+
+    void touch(std::size_t id);
+
+    void prefetch_pool(std::size_t id) const;
+
+    void prefetch_row(std::size_t id);
+
+    ResolvedSwap resolve_swap(const SwapOp& op);
+};
+
+std::size_t PoolEngine::add_pool(const std::vector<std::string>& tokens) {
+    pools.emplace_back(tokens);
+    last_used.push_back(batch_clock);
+    index.add_pool(pools.size() - 1, tokens);
+    return pools.size() - 1;
+}
+
+InfinityPool& PoolEngine::pool(std::size_t id) {
+    InfinityPool& p = pools.at(id);
+    touch(id);
+    return p;
+}
+
+const InfinityPool& PoolEngine::pool(std::size_t id) const {
+    return pools.at(id);
+}
+
+std::size_t PoolEngine::size() const {
+    return pools.size();
+}
+
+const TokenIndex& PoolEngine::token_index() const {
+    return index;
+}
+
+void PoolEngine::touch(std::size_t id) {
+    last_used[id] = batch_clock;
+}
+
+std::vector<double> PoolEngine::execute_swaps(const std::vector<SwapOp>& ops) {
+    std::vector<double> amount_out;
+    amount_out.reserve(ops.size());
+    ++batch_clock;
+    for (const auto& op : ops) {
+        InfinityPool& p = pools.at(op.pool);
+        touch(op.pool);
+        amount_out.push_back(p.swap(op.t_in, op.t_out, op.amount_in));
+    }
+    return amount_out;
+}
+
+void PoolEngine::prefetch_pool(std::size_t id) const {
+    const char* p = reinterpret_cast<const char*>(&pools[id]);
+    for (std::size_t offset = 0; offset < sizeof(InfinityPool); offset += 64) {
+        INFINITY_POOL_PREFETCH(p + offset, 1);
+    }
+}
+
+void PoolEngine::prefetch_row(std::size_t id) {
+    InfinityPool& p = pools[id];
+    if (!p.refresh_row()) {
+        return;
+    }
+    INFINITY_POOL_PREFETCH(p.row.hash.data(), 0);
+    INFINITY_POOL_PREFETCH(p.row.balance.data(), 0);
+    INFINITY_POOL_PREFETCH(p.row.weight.data(), 0);
+}
+
+// The row's hashes and pointers were prefetched a stage ago, so finding the
+// tokens is a scan over one or two cache lines; execution confirms each match
+// against the token name, which is prefetched here with the balance nodes.
+PoolEngine::ResolvedSwap PoolEngine::resolve_swap(const SwapOp& op) {
+    const InfinityPool& p = pools[op.pool];
+    const std::size_t k = p.row.balance.size();
+    if (k != p.tokens.size()) {
+        return {nullptr, nullptr, nullptr, nullptr, 0, 0};
+    }
+    const std::size_t h_in = std::hash<std::string>()(op.t_in);
+    const std::size_t h_out = std::hash<std::string>()(op.t_out);
+    std::size_t t_in = k;
+    std::size_t t_out = k;
+    for (std::size_t t = 0; t < k; ++t) {
+        t_in = t_in == k && p.row.hash[t] == h_in ? t : t_in;
+        t_out = t_out == k && p.row.hash[t] == h_out ? t : t_out;
+    }
+    if (t_in == k || t_out == k) {
+        return {nullptr, nullptr, nullptr, nullptr, 0, 0};
+    }
+    INFINITY_POOL_PREFETCH(p.row.balance[t_in], 1);
+    INFINITY_POOL_PREFETCH(p.row.balance[t_out], 1);
+    INFINITY_POOL_PREFETCH(&p.tokens[t_in], 0);
+    INFINITY_POOL_PREFETCH(&p.tokens[t_out], 0);
+    return {p.row.balance[t_in], p.row.balance[t_out], &p.row.weight[t_in], &p.row.weight[t_out], t_in, t_out};
+}
+
+std::vector<double> PoolEngine::execute_swaps_prefetched(const std::vector<SwapOp>& ops) {
+    for (const auto& op : ops) {
+        if (op.pool >= pools.size()) {
+            throw std::out_of_range("Swap references an unknown pool.");
+        }
+    }
+
+    std::vector<double> amount_out(ops.size());
+    ResolvedSwap ring[PREFETCH_DISTANCE];
+    ++batch_clock;
+
+    // warm-up: fill the three stages for the first ops
+    const std::size_t n = ops.size();
+    for (std::size_t i = 0; i < std::min(3 * PREFETCH_DISTANCE, n); ++i) {
+        prefetch_pool(ops[i].pool);
+    }
+    for (std::size_t i = 0; i < std::min(2 * PREFETCH_DISTANCE, n); ++i) {
+        prefetch_row(ops[i].pool);
+    }
+    for (std::size_t i = 0; i < std::min(PREFETCH_DISTANCE, n); ++i) {
+        ring[i % PREFETCH_DISTANCE] = resolve_swap(ops[i]);
+    }
+
+    for (std::size_t i = 0; i < n; ++i) {
+        if (i + 3 * PREFETCH_DISTANCE < n) {
+            prefetch_pool(ops[i + 3 * PREFETCH_DISTANCE].pool);
+        }
+        if (i + 2 * PREFETCH_DISTANCE < n) {
+            prefetch_row(ops[i + 2 * PREFETCH_DISTANCE].pool);
+        }
+
+        const SwapOp& op = ops[i];
+        ResolvedSwap r = ring[i % PREFETCH_DISTANCE];
+        InfinityPool& p = pools[op.pool];
+        touch(op.pool);
+
+        // a hash match is only a candidate until the names agree; anything
+        // unusual goes through swap() for its exact errors
+        if (r.b_in == nullptr || p.tokens[r.t_in] != op.t_in || p.tokens[r.t_out] != op.t_out || op.t_in == op.t_out || p.weights.empty() ||
+            op.amount_in <= 0 || *r.b_in < op.amount_in) {
+            amount_out[i] = p.swap(op.t_in, op.t_out, op.amount_in);
+        } else {
+            double out = p.swap_output(*r.b_in, *r.b_out, *r.w_in, *r.w_out, op.amount_in);
+            *r.b_in -= op.amount_in;
+            *r.b_out += out;
+            p.set_invariant();
+            amount_out[i] = out;
+        }
+
+        if (i + PREFETCH_DISTANCE < n) {
+            ring[i % PREFETCH_DISTANCE] = resolve_swap(ops[i + PREFETCH_DISTANCE]);
+        }
+    }
+    return amount_out;
+}
+
+std::vector<unsigned char> PoolEngine::validate_swaps(const std::vector<SwapOp>& ops) {
+    const std::size_t n = ops.size();
+    scratch_amount.resize(n);
+    scratch_balance.resize(n);
+    scratch_ready.resize(n);
+
+    // gather: the hash lookups are the only data-dependent part
+    for (std::size_t i = 0; i < n; ++i) {
+        const SwapOp& op = ops[i];
+        scratch_amount[i] = op.amount_in;
+        scratch_balance[i] = 0.0;
+        scratch_ready[i] = 0;
+        if (op.pool >= pools.size()) {
+            continue;
+        }
+        // execution dereferences both balance entries, so both must exist;
+        // finding the weights also implies they are assigned
+        const InfinityPool& p = pools[op.pool];
+        auto b_in = p.balances.find(op.t_in);
+        bool found = b_in != p.balances.end() && p.balances.count(op.t_out) && p.weights.count(op.t_in) && p.weights.count(op.t_out);
+        scratch_balance[i] = found ? b_in->second : 0.0;
+        scratch_ready[i] = found & (op.t_in != op.t_out);
+    }
+
+    // predicate pass over flat arrays, written with bitwise ops so it vectorizes
+    std::vector<unsigned char> accept(n);
+    const double* amount = scratch_amount.data();
+    const double* balance = scratch_balance.data();
+    const unsigned char* ready = scratch_ready.data();
+    for (std::size_t i = 0; i < n; ++i) {
+        accept[i] = static_cast<unsigned char>((amount[i] > 0.0) & (amount[i] <= balance[i]) & (ready[i] != 0));
+    }
+    return accept;
+}
+
+std::vector<unsigned char> PoolEngine::validate_deposits(const std::vector<DepositOp>& ops, double tolerance) {
+    std::vector<unsigned char> accept(ops.size());
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        const DepositOp& op = ops[i];
+        if (op.pool >= pools.size()) {
+            continue;
+        }
+        const InfinityPool& p = pools[op.pool];
+        const std::size_t k = p.tokens.size();
+
+        // dense rows in token order; a missing token reads as NaN and fails every comparison
+        scratch_amount.resize(k);
+        scratch_balance.resize(k);
+        for (std::size_t t = 0; t < k; ++t) {
+            auto a = op.amount_in.find(p.tokens[t]);
+            auto b = p.balances.find(p.tokens[t]);
+            scratch_amount[t] = a != op.amount_in.end() ? a->second : std::numeric_limits<double>::quiet_NaN();
+            scratch_balance[t] = b != p.balances.end() ? b->second : std::numeric_limits<double>::quiet_NaN();
+        }
+
+        double balance_sum = std::accumulate(scratch_balance.begin(), scratch_balance.end(), 0.0);
+        accept[i] = op.amount_in.size() == k && dense_deposit_ratio(scratch_amount.data(), scratch_balance.data(), balance_sum, k, tolerance);
+    }
+    return accept;
+}
+
+std::vector<double> PoolEngine::execute_validated_swaps(const std::vector<SwapOp>& ops) {
+    std::vector<unsigned char> accept = validate_swaps(ops);
+    std::vector<double> amount_out(ops.size(), std::numeric_limits<double>::quiet_NaN());
+    ++batch_clock;
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        if (!accept[i]) {
+            continue;
+        }
+        const SwapOp& op = ops[i];
+        InfinityPool& p = pools[op.pool];
+        touch(op.pool);
+        double& b_in = p.balances.find(op.t_in)->second;
+        double& b_out = p.balances.find(op.t_out)->second;
+        // the mask was taken before the batch ran, so earlier ops may have drained t_in
+        if (b_in < op.amount_in) {
+            continue;
+        }
+        double out = p.swap_output(b_in, b_out, p.weights.find(op.t_in)->second, p.weights.find(op.t_out)->second, op.amount_in);
+        b_in -= op.amount_in;
+        b_out += out;
+        p.set_invariant();
+        amount_out[i] = out;
+    }
+    return amount_out;
+}
+
+std::vector<double> PoolEngine::execute_validated_deposits(const std::vector<DepositOp>& ops) {
+    std::vector<unsigned char> accept = validate_deposits(ops);
+    std::vector<double> shares(ops.size(), std::numeric_limits<double>::quiet_NaN());
+    ++batch_clock;
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        if (!accept[i]) {
+            continue;
+        }
+        InfinityPool& p = pools[ops[i].pool];
+        touch(ops[i].pool);
+        for (const auto& entry : ops[i].amount_in) {
+            p.balances[entry.first] += entry.second;
+        }
+        if (!p.weights.empty()) {
+            p.set_invariant();
+        }
+        shares[i] = (ops[i].amount_in.at(p.tokens[0]) * SUPPLY) / p.balances.at(p.tokens[0]);
+    }
+    return shares;
+}
+
+std::vector<double> PoolEngine::execute_block(const std::vector<SwapOp>& ops) {
+    const std::size_t n = ops.size();
+    std::vector<double> amount_out(n, std::numeric_limits<double>::quiet_NaN());
+    ++batch_clock;
+
+    // stable counting sort of op indices by pool; unknown pools are dropped
+    scratch_offset.assign(pools.size() + 1, 0);
+    for (const auto& op : ops) {
+        if (op.pool < pools.size()) {
+            ++scratch_offset[op.pool + 1];
+        }
+    }
+    for (std::size_t id = 0; id < pools.size(); ++id) {
+        scratch_offset[id + 1] += scratch_offset[id];
+    }
+    scratch_order.resize(scratch_offset[pools.size()]);
+    for (std::size_t i = 0; i < n; ++i) {
+        if (ops[i].pool < pools.size()) {
+            scratch_order[scratch_offset[ops[i].pool]++] = i;
+        }
+    }
+
+    // scratch_offset[id] now ends pool id's run, which starts where id - 1 ends
+    std::size_t begin = 0;
+    for (std::size_t id = 0; id < pools.size(); ++id) {
+        const std::size_t end = scratch_offset[id];
+        if (begin == end) {
+            continue;
+        }
+        InfinityPool& p = pools[id];
+        touch(id);
+        bool changed = false;
+        for (std::size_t k = begin; k < end; ++k) {
+            const std::size_t i = scratch_order[k];
+            const SwapOp& op = ops[i];
+            auto b_in = p.balances.find(op.t_in);
+            auto b_out = p.balances.find(op.t_out);
+            auto w_in = p.weights.find(op.t_in);
+            auto w_out = p.weights.find(op.t_out);
+            if (b_in == p.balances.end() || b_out == p.balances.end() || w_in == p.weights.end() || w_out == p.weights.end() ||
+                op.t_in == op.t_out || !(op.amount_in > 0) || b_in->second < op.amount_in) {
+                continue;
+            }
+            double out = p.swap_output(b_in->second, b_out->second, w_in->second, w_out->second, op.amount_in);
+            b_in->second -= op.amount_in;
+            b_out->second += out;
+            amount_out[i] = out;
+            changed = true;
+        }
+        if (changed) {
+            p.set_invariant();
+        }
+        begin = end;
+    }
+    return amount_out;
+}
+
+EngineFootprint PoolEngine::memory_footprint() const {
+    std::size_t pool_bytes = 0;
+    for (const auto& p : pools) {
+        pool_bytes += p.memory_footprint().total();
+    }
+    std::size_t table_bytes =
+        (pools.capacity() - pools.size()) * sizeof(InfinityPool) + last_used.capacity() * sizeof(std::uint64_t) + index.memory_bytes();
+    std::size_t scratch_bytes = scratch_amount.capacity() * sizeof(double) + scratch_balance.capacity() * sizeof(double) + scratch_ready.capacity() +
+                                (scratch_order.capacity() + scratch_offset.capacity()) * sizeof(std::size_t);
+    return {pool_bytes, table_bytes, scratch_bytes};
+}
+
+std::size_t PoolEngine::compact(std::uint64_t idle_batches) {
+    std::size_t before = memory_footprint().total();
+
+    // one pool at a time, so the peak overhead is a single pool's copy
+    for (std::size_t id = 0; id < pools.size(); ++id) {
+        InfinityPool rebuilt(pools[id]);
+        if (batch_clock - last_used[id] >= idle_batches) {
+            rebuilt.shrink_to_fit();
+        }
+        pools[id] = std::move(rebuilt);
+    }
+    pools.shrink_to_fit();
+    last_used.shrink_to_fit();
+
+    std::vector<double>().swap(scratch_amount);
+    std::vector<double>().swap(scratch_balance);
+    std::vector<unsigned char>().swap(scratch_ready);
+    std::vector<std::size_t>().swap(scratch_order);
+    std::vector<std::size_t>().swap(scratch_offset);
+
+    std::size_t after = memory_footprint().total();
+    return before > after ? before - after : 0;
+}
+
+// TIERED POOL STORE
+
+// Holds at most `capacity` pools materialized as InfinityPool objects; every
+// other pool is kept as its to_bytes() encoding and decoded on first touch,
+// evicting the least recently used hot pool. A standalone container for now:
+// PoolEngine keeps every pool materialized, since its validation and prefetch
+// paths index `pools` directly and pool() hands out long-lived references,
+// and its compact() only shrinks idle pools in place.
+class TieredPoolStore {
+public:
+    explicit TieredPoolStore(std::size_t capacity);
+
+    std::size_t add(const InfinityPool& pool);
+
+    // the reference stays valid until a later get() evicts this pool
+    InfinityPool& get(std::size_t id);
+
+    void evict(std::size_t id);
+
+    bool is_hot(std::size_t id) const;
+
+    std::size_t size() const;
+
+    std::size_t hot_count() const;
+
+    std::size_t materializations() const;
+
+    std::size_t memory_bytes() const;
+
+private:
+    struct Slot {
+        std::unique_ptr<InfinityPool> hot;
+        std::string cold;
+        std::list<std::size_t>::iterator lru;
+    };
+
+    std::size_t capacity;
+    std::size_t loads = 0;
+    std::vector<Slot> slots;
+    std::list<std::size_t> lru;  // hot pool ids, most recently used first
+};
+
+TieredPoolStore::TieredPoolStore(std::size_t capacity) : capacity(capacity) {
+    if (capacity == 0) {
+        throw std::invalid_argument("Tiered store needs room for at least one hot pool.");
+    }
+}
+
+std::size_t TieredPoolStore::add(const InfinityPool& pool) {
+    slots.push_back({nullptr, pool.to_bytes(), lru.end()});
+    return slots.size() - 1;
+}
+
+InfinityPool& TieredPoolStore::get(std::size_t id) {
+    Slot& slot = slots.at(id);
+    if (slot.hot) {
+        lru.splice(lru.begin(), lru, slot.lru);
+        return *slot.hot;
+    }
+
+    if (lru.size() >= capacity) {
+        evict(lru.back());
+    }
+    slot.hot = std::make_unique<InfinityPool>(InfinityPool::from_bytes(slot.cold));
+    std::string().swap(slot.cold);
+    lru.push_front(id);
+    slot.lru = lru.begin();
+    ++loads;
+    return *slot.hot;
+}
+
+void TieredPoolStore::evict(std::size_t id) {
+    Slot& slot = slots.at(id);
+    if (!slot.hot) {
+        return;
+    }
+    slot.cold = slot.hot->to_bytes();
+    slot.hot.reset();
+    lru.erase(slot.lru);
+    slot.lru = lru.end();
+}
+
+bool TieredPoolStore::is_hot(std::size_t id) const {
+    return slots.at(id).hot != nullptr;
+}
+
+std::size_t TieredPoolStore::size() const {
+    return slots.size();
+}
+
+std::size_t TieredPoolStore::hot_count() const {
+    return lru.size();
+}
+
+std::size_t TieredPoolStore::materializations() const {
+    return loads;
+}
+
+std::size_t TieredPoolStore::memory_bytes() const {
+    std::size_t bytes = slots.capacity() * sizeof(Slot) + lru.size() * (sizeof(std::size_t) + 2 * sizeof(void*));
+    for (const auto& slot : slots) {
+        bytes += slot.hot ? slot.hot->memory_footprint().total() : string_heap_bytes(slot.cold);
+    }
+    return bytes;
+}
+
+// WORKLOAD GENERATOR
+
+enum class OpKind {
+    QUOTE,
+    SWAP,
+    DEPOSIT_ALL,
+    DEPOSIT_ONE,
+    DEPOSIT_ANY,
+    WITHDRAW_ALL,
+    WITHDRAW_ONE,
+    WITHDRAW_ANY,
+    EQUALIZE,
+};
+
+[[maybe_unused]] static const char* op_kind_name(OpKind kind) {
+    switch (kind) {
+        case OpKind::QUOTE: return "quote";
+        case OpKind::SWAP: return "swap";
+        case OpKind::DEPOSIT_ALL: return "deposit_all";
+        case OpKind::DEPOSIT_ONE: return "deposit_one";
+        case OpKind::DEPOSIT_ANY: return "deposit_any";
+        case OpKind::WITHDRAW_ALL: return "withdraw_all";
+        case OpKind::WITHDRAW_ONE: return "withdraw_one";
+        case OpKind::WITHDRAW_ANY: return "withdraw_any";
+        case OpKind::EQUALIZE: return "equalize";
+    }
+    return "unknown";
+}
+
+struct WorkloadOp {
+    OpKind kind;
+    std::size_t pool;
+    std::string t_in;                                 // swap input, quoted asset, single-asset token
+    std::string t_out;                                // swap output, quote currency
+    double amount;                                    // swap input or shares redeemed
+    std::unordered_map<std::string, double> amounts;  // multi-asset deposit, withdrawal ratios, equalize inputs
+};
+
+struct WorkloadConfig {
+    std::uint64_t seed = 1;
+    double zipf_exponent = 1.1;  // pool popularity skew, 0 is uniform
+    double read_ratio = 0.5;     // fraction of ops that are quotes
+    double tail_index = 1.5;     // Pareto shape of sizes, lower is heavier
+    double min_size = 1e-6;      // smallest op as a fraction of the pool balance
+    double max_size = 0.1;       // largest op as a fraction of the pool balance
+    // relative frequencies of the write kinds
+    double swap_weight = 0.8;
+    double deposit_weight = 0.08;
+    double withdraw_weight = 0.08;
+    double equalize_weight = 0.04;
+};
+
+// Ops are sized from the pool state at the time they are generated, so
+// calling next() right before executing keeps nearly all of them valid;
+// generate() sizes a whole stream against one snapshot.
+class WorkloadGenerator {
+public:
+    WorkloadGenerator(const PoolEngine& engine, const WorkloadConfig& config);
+
+    WorkloadOp next();
+
+    std::vector<WorkloadOp> generate(std::size_t count);
+
+private:
+    const PoolEngine& engine;
+    WorkloadConfig config;
+    std::mt19937_64 rng;
+    std::vector<double> popularity;  // cumulative Zipf weights by rank
+    std::vector<std::size_t> ranked;  // pool id at each popularity rank
+
+    std::size_t pick_pool();
+
+    double pick_size();
+
+    OpKind pick_kind();
+};
+
+WorkloadGenerator::WorkloadGenerator(const PoolEngine& engine, const WorkloadConfig& config)
+    : engine(engine), config(config), rng(config.seed) {
+    if (engine.size() == 0) {
+        throw std::invalid_argument("Workload needs at least one pool.");
+    }
+    double total = 0.0;
+    popularity.reserve(engine.size());
+    for (std::size_t rank = 1; rank <= engine.size(); ++rank) {
+        total += 1.0 / std::pow(static_cast<double>(rank), config.zipf_exponent);
+        popularity.push_back(total);
+    }
+    ranked.resize(engine.size());
+    std::iota(ranked.begin(), ranked.end(), 0);
+    std::shuffle(ranked.begin(), ranked.end(), rng);
+}
+
+std::size_t WorkloadGenerator::pick_pool() {
+    double u = std::uniform_real_distribution<double>(0.0, popularity.back())(rng);
+    std::size_t rank = std::lower_bound(popularity.begin(), popularity.end(), u) - popularity.begin();
+    return ranked[std::min(rank, ranked.size() - 1)];
+}
+
+double WorkloadGenerator::pick_size() {
+    double u = std::uniform_real_distribution<double>(std::numeric_limits<double>::min(), 1.0)(rng);
+    return std::min(config.max_size, config.min_size * std::pow(u, -1.0 / config.tail_index));
+}
+
+OpKind WorkloadGenerator::pick_kind() {
+    if (std::bernoulli_distribution(config.read_ratio)(rng)) {
+        return OpKind::QUOTE;
+    }
+    std::discrete_distribution<int> write({config.swap_weight, config.deposit_weight, config.withdraw_weight, config.equalize_weight});
+    switch (write(rng)) {
+        case 0: return OpKind::SWAP;
+        case 1: {
+            const OpKind kinds[] = {OpKind::DEPOSIT_ALL, OpKind::DEPOSIT_ONE, OpKind::DEPOSIT_ANY};
+            return kinds[std::uniform_int_distribution<int>(0, 2)(rng)];
+        }
+        case 2: {
+            const OpKind kinds[] = {OpKind::WITHDRAW_ALL, OpKind::WITHDRAW_ONE, OpKind::WITHDRAW_ANY};
+            return kinds[std::uniform_int_distribution<int>(0, 2)(rng)];
+        }
+        default: return OpKind::EQUALIZE;
+    }
+}
+
+WorkloadOp WorkloadGenerator::next() {
+    WorkloadOp op{pick_kind(), pick_pool(), "", "", 0.0, {}};
+    const InfinityPool& pool = engine.pool(op.pool);
+    const std::vector<std::string>& tokens = pool.get_tokens();
+    std::uniform_int_distribution<std::size_t> token(0, tokens.size() - 1);
+    std::size_t t_in = token(rng);
+    std::size_t t_out = (t_in + 1 + token(rng) % (tokens.size() - 1)) % tokens.size();
+    op.t_in = tokens[t_in];
+    op.t_out = tokens[t_out];
+    double size = pick_size();
+
+    switch (op.kind) {
+        case OpKind::QUOTE:
+            break;
+        case OpKind::SWAP:
+            op.amount = size * pool.get_balance(op.t_in);
+            break;
+        case OpKind::DEPOSIT_ONE:
+            for (const auto& t : tokens) {
+                op.amounts[t] = t == op.t_in ? size * pool.get_balance(t) : 0.0;
+            }
+            break;
+        case OpKind::DEPOSIT_ALL:
+        case OpKind::DEPOSIT_ANY:
+        case OpKind::EQUALIZE:
+            for (const auto& t : tokens) {
+                op.amounts[t] = size * pool.get_balance(t);
+            }
+            break;
+        case OpKind::WITHDRAW_ALL:
+        case OpKind::WITHDRAW_ONE:
+            op.amount = size * SUPPLY;
+            break;
+        case OpKind::WITHDRAW_ANY:
+            op.amount = size * SUPPLY;
+            for (const auto& t : tokens) {
+                op.amounts[t] = pool.get_balance(t);
+            }
+            break;
+    }
+    return op;
+}
+
+std::vector<WorkloadOp> WorkloadGenerator::generate(std::size_t count) {
+    std::vector<WorkloadOp> ops;
+    ops.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        ops.push_back(next());
+    }
+    return ops;
+}
+
+// runs one op; returns the quote, the amount out or the shares issued
+// (summed over tokens for multi-asset results); pool errors propagate
+static double apply_workload_op(PoolEngine& engine, const WorkloadOp& op) {
+    InfinityPool& pool = engine.pool(op.pool);
+    auto total = [](const std::unordered_map<std::string, double>& amounts) {
+        double sum = 0.0;
+        for (const auto& entry : amounts) {
+            sum += entry.second;
+        }
+        return sum;
+    };
+    switch (op.kind) {
+        case OpKind::QUOTE: return pool.calculate_spot_price(op.t_in, op.t_out);
+        case OpKind::SWAP: return pool.swap(op.t_in, op.t_out, op.amount);
+        case OpKind::DEPOSIT_ALL: return pool.deposit_all(op.amounts);
+        case OpKind::DEPOSIT_ONE: return pool.deposit_one(op.amounts);
+        case OpKind::DEPOSIT_ANY: return pool.deposit_any(op.amounts);
+        case OpKind::WITHDRAW_ALL: return total(pool.withdraw_all(op.amount));
+        case OpKind::WITHDRAW_ONE: return pool.withdraw_one(op.t_in, op.amount);
+        case OpKind::WITHDRAW_ANY: return total(pool.withdraw_any(op.amount, op.amounts));
+        case OpKind::EQUALIZE: return total(pool.equalize(op.amounts, op.amounts));
+    }
+    return 0.0;
+}
+
+// POOL SERVER
+
+// In-process request server over a PoolEngine. Pools are sharded across
+// worker threads by id, so each pool is only ever touched by one worker and
+// its ops run in submission order without locking. The engine must not gain
+// pools while the server runs.
+class PoolServer {
+public:
+    using Completion = std::function<void(double result, bool ok)>;
+
+    PoolServer(PoolEngine& engine, std::size_t workers);
+
+    ~PoolServer();
+
+    PoolServer(const PoolServer&) = delete;
+
+    PoolServer& operator=(const PoolServer&) = delete;
+
+    // `done` runs on the worker thread once the op has executed
+    void submit(const WorkloadOp& op, Completion done);
+
+    void stop();
+
+private:
+    struct Request {
+        WorkloadOp op;
+        Completion done;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<Request> queue;
+        bool stopping = false;
+        std::thread worker;
+    };
+
+    PoolEngine& engine;
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    void serve(Shard& shard);
+};
+
+PoolServer::PoolServer(PoolEngine& engine, std::size_t workers) : engine(engine) {
+    if (workers == 0) {
+        throw std::invalid_argument("Pool server needs at least one worker.");
+    }
+    for (std::size_t i = 0; i < workers; ++i) {
+        shards.emplace_back(new Shard());
+    }
+    for (auto& shard : shards) {
+        Shard* s = shard.get();
+        s->worker = std::thread([this, s] { serve(*s); });
+    }
+}
+
+PoolServer::~PoolServer() {
+    stop();
+}
+
+void PoolServer::submit(const WorkloadOp& op, Completion done) {
+    Shard& shard = *shards[op.pool % shards.size()];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (shard.stopping) {
+            throw std::runtime_error("Pool server is stopped.");
+        }
+        shard.queue.push_back({op, std::move(done)});
+    }
+    shard.ready.notify_one();
+}
+
+void PoolServer::stop() {
+    for (auto& shard : shards) {
+        {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->stopping = true;
+        }
+        shard->ready.notify_one();
+    }
+    for (auto& shard : shards) {
+        if (shard->worker.joinable()) {
+            shard->worker.join();
+        }
+    }
+}
+
+void PoolServer::serve(Shard& shard) {
+    std::deque<Request> batch;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(shard.mutex);
+            shard.ready.wait(lock, [&] { return shard.stopping || !shard.queue.empty(); });
+            if (shard.queue.empty()) {
+                return;
+            }
+            batch.swap(shard.queue);
+        }
+        for (auto& request : batch) {
+            double result = 0.0;
+            bool ok = true;
+            try {
+                result = apply_workload_op(engine, request.op);
+            } catch (const std::exception&) {
+                ok = false;
+            }
+            if (request.done) {
+                request.done(result, ok);
+            }
+        }
+        batch.clear();
+    }
+}
+
+// LP ANALYTICS
+
+const std::size_t NO_LP = std::numeric_limits<std::size_t>::max();
+
+struct JournalEntry {
+    std::size_t lp;                // NO_LP for trades
+    double shares;                 // shares the pool reported minting (+) or redeeming (-), kept as recorded
+    std::vector<double> flow;      // lp's token flow into the pool, in token order
+    std::vector<double> balances;  // pool balances after the entry, in token order
+    double invariant;              // pool invariant after the entry
+};
+
+// Append-only history of one pool: LP deposits and withdrawals with their
+// share and token flows, and the pool state after every event.
+class PoolJournal {
+public:
+    explicit PoolJournal(const InfinityPool& pool);
+
+    void record_trade(const InfinityPool& pool);
+
+    void record_deposit(const InfinityPool& pool, std::size_t lp, double shares, const std::unordered_map<std::string, double>& amount_in);
+
+    void record_withdrawal(const InfinityPool& pool, std::size_t lp, double shares, const std::unordered_map<std::string, double>& amount_out);
+
+    const std::vector<std::string>& tokens() const;
+
+    const std::vector<double>& weights() const;
+
+    const std::vector<JournalEntry>& entries() const;
+
+private:
+    std::vector<std::string> names;
+    std::vector<double> token_weights;
+    std::vector<JournalEntry> history;
+
+    void record(const InfinityPool& pool, std::size_t lp, double shares, const std::unordered_map<std::string, double>& amounts, double sign);
+};
+
+PoolJournal::PoolJournal(const InfinityPool& pool) : names(pool.get_tokens()) {
+    if (!pool.is_initialized()) {
+        throw std::invalid_argument("Journal requires a pool with assigned weights.");
+    }
+    for (const auto& token : names) {
+        token_weights.push_back(pool.get_weight(token));
+    }
+}
+
+void PoolJournal::record(const InfinityPool& pool, std::size_t lp, double shares, const std::unordered_map<std::string, double>& amounts, double sign) {
+    JournalEntry entry{lp, shares, std::vector<double>(names.size()), std::vector<double>(names.size()), pool.get_invariant()};
+    for (std::size_t t = 0; t < names.size(); ++t) {
+        auto amount = amounts.find(names[t]);
+        entry.flow[t] = amount != amounts.end() ? sign * amount->second : 0.0;
+        entry.balances[t] = pool.get_balance(names[t]);
+    }
+    history.push_back(std::move(entry));
+}
+
+void PoolJournal::record_trade(const InfinityPool& pool) {
+    record(pool, NO_LP, 0.0, {}, 0.0);
+}
+
+void PoolJournal::record_deposit(const InfinityPool& pool, std::size_t lp, double shares, const std::unordered_map<std::string, double>& amount_in) {
+    record(pool, lp, shares, amount_in, 1.0);
+}
+
+void PoolJournal::record_withdrawal(const InfinityPool& pool, std::size_t lp, double shares, const std::unordered_map<std::string, double>& amount_out) {
+    record(pool, lp, -shares, amount_out, -1.0);
+}
+
+const std::vector<std::string>& PoolJournal::tokens() const {
+    return names;
+}
+
+const std::vector<double>& PoolJournal::weights() const {
+    return token_weights;
+}
+
+const std::vector<JournalEntry>& PoolJournal::entries() const {
+    return history;
+}
+
+// All values are in units of the pool's first token at the final spot prices.
+// The pool charges no swap fee; swap() simply does not preserve the
+// invariant, so trades move it and that drift is reported on its own.
+struct LpReport {
+    double position_value;    // share of the pool held at the end
+    double hold_value;        // the LP's net deposited tokens, had they been held instead
+    double pnl_vs_hold;       // position_value - hold_value
+    double invariant_drift;   // value from trades moving the invariant while holding a share
+    double impermanent_loss;  // invariant_drift - pnl_vs_hold: loss against holding, drift excluded
+};
+
+// One pass over the journal for every LP at once. Ownership is in units
+// where the liquidity present when the journal starts is one unit; an LP
+// event mints or burns units in proportion to its flow's value against the
+// pool's value at the entry's prices, so it does not depend on the share
+// unit the pool reports. Drift is tracked with a global accumulator of
+// trade-driven invariant change per unit, settled into an LP only at its
+// own events, so trades cost O(1) regardless of the number of LPs; the
+// final valuation is a token-major sweep over all LPs.
+[[maybe_unused]] static std::vector<LpReport> analyze_lps(const PoolJournal& journal, std::size_t lp_count) {
+    const std::size_t n = journal.tokens().size();
+    const std::vector<double>& w = journal.weights();
+
+    std::vector<double> shares(lp_count);
+    std::vector<double> checkpoint(lp_count);
+    std::vector<double> drift(lp_count);
+    std::vector<double> net(n * lp_count);  // token-major: net[t * lp_count + lp]
+
+    double total_shares = 1.0;
+    double accrued = 0.0;  // drift value per unit, summed over all trades so far
+    double invariant = 0.0;
+    const std::vector<double>* balances = nullptr;
+
+    for (const auto& entry : journal.entries()) {
+        if (entry.lp == NO_LP) {
+            // pool value in first-token units is b0 / w0 on a weighted-product curve
+            if (total_shares > 0.0 && invariant > 0.0) {
+                accrued += (entry.invariant - invariant) / total_shares * (entry.balances[0] / w[0]) / entry.invariant;
+            }
+        } else {
+            if (entry.lp >= lp_count) {
+                throw std::invalid_argument("Journal references an LP outside the report.");
+            }
+            std::size_t lp = entry.lp;
+            drift[lp] += shares[lp] * (accrued - checkpoint[lp]);
+            checkpoint[lp] = accrued;
+
+            // a flow worth v against a pool worth V after it owns v / V of that
+            // pool, i.e. total * v / (V - v) new units; withdrawals have v < 0
+            const double pool_value = entry.balances[0] / w[0];
+            double flow_value = 0.0;
+            for (std::size_t t = 0; t < n; ++t) {
+                flow_value += entry.flow[t] * w[t] / entry.balances[t];
+                net[t * lp_count + lp] += entry.flow[t];
+            }
+            flow_value *= pool_value;
+            double units = total_shares * flow_value / (pool_value - flow_value);
+            shares[lp] += units;
+            total_shares += units;
+        }
+        invariant = entry.invariant;
+        balances = &entry.balances;
+    }
+
+    std::vector<LpReport> reports(lp_count);
+    if (balances == nullptr) {
+        return reports;
+    }
+
+    std::vector<double> hold(lp_count);
+    const double numeraire = (*balances)[0] / w[0];
+    for (std::size_t t = 0; t < n; ++t) {
+        const double price = numeraire / ((*balances)[t] / w[t]);
+        const double* token_net = net.data() + t * lp_count;
+        for (std::size_t lp = 0; lp < lp_count; ++lp) {
+            hold[lp] += token_net[lp] * price;
+        }
+    }
+
+    const double value_per_share = total_shares > 0.0 ? numeraire / total_shares : 0.0;
+    for (std::size_t lp = 0; lp < lp_count; ++lp) {
+        double position = shares[lp] * value_per_share;
+        double moved = drift[lp] + shares[lp] * (accrued - checkpoint[lp]);
+        double pnl = position - hold[lp];
+        reports[lp] = {position, hold[lp], pnl, moved, moved - pnl};
+    }
+    return reports;
+}
+
+// RISK ENGINE
+
+// Balances an arbitrageur leaves a weighted-product pool with once its spot
+// prices match `prices`: V = k * prod((p_t / w_t)^w_t) is the pool value and
+// b_t = w_t * V / p_t. Weights must sum to one.
+static std::vector<double> arbitrage_balances(double invariant, const std::vector<double>& weights, const std::vector<double>& prices) {
+    if (weights.size() != prices.size()) {
+        throw std::invalid_argument("Weights and prices must have the same length.");
+    }
+    double log_value = std::log(invariant);
+    for (std::size_t t = 0; t < weights.size(); ++t) {
+        log_value += weights[t] * std::log(prices[t] / weights[t]);
+    }
+    const double value = std::exp(log_value);
+    std::vector<double> balances(weights.size());
+    for (std::size_t t = 0; t < weights.size(); ++t) {
+        balances[t] = weights[t] * value / prices[t];
+    }
+    return balances;
+}
+
+struct LpPosition {
+    std::size_t pool;
+    double fraction;  // of the pool owned
+};
+
+struct RiskConfig {
+    std::size_t scenarios = 10000;
+    double horizon = 1.0 / 365.0;  // years
+    double confidence = 0.99;
+    std::uint64_t seed = 1;
+    std::size_t threads = 0;  // 0 uses every hardware thread
+};
+
+struct RiskReport {
+    double value;  // positions at today's prices
+    double var;    // loss not exceeded with probability `confidence`
+    double cvar;   // mean loss beyond var
+};
+
+// Values LP positions under correlated lognormal price scenarios, assuming
+// each pool is arbitraged to the scenario prices. A position is then worth
+// fraction * k * prod((p_t / w_t)^w_t), i.e. exp of an affine function of the
+// log prices, so pools are stored slot-major (one array per token slot,
+// padded with zero weights) and every scenario is a flat sweep over pools.
+class RiskEngine {
+public:
+    // correlation is row-major over `tokens`; prices and volatility are per token (annualized)
+    RiskEngine(const PoolEngine& engine, const std::vector<LpPosition>& positions, const std::vector<std::string>& tokens,
+               const std::vector<double>& prices, const std::vector<double>& volatility, const std::vector<double>& correlation);
+
+    double value(const std::vector<double>& log_prices) const;
+
+    RiskReport run(const RiskConfig& config) const;
+
+private:
+    std::size_t universe;
+    std::size_t positions;
+    std::size_t slots;
+    std::vector<double> log_spot;
+    std::vector<double> sigma;
+    std::vector<double> cholesky;       // lower triangle, row-major
+    std::vector<std::size_t> slot_token;  // [slot * positions + position]
+    std::vector<double> slot_weight;      // [slot * positions + position]
+    std::vector<double> log_scale;        // log(fraction * k) - sum(w log w)
+
+    void scenario_log_prices(std::mt19937_64& rng, const RiskConfig& config, std::vector<double>& z, std::vector<double>& out) const;
+};
+
+RiskEngine::RiskEngine(const PoolEngine& engine, const std::vector<LpPosition>& positions, const std::vector<std::string>& tokens,
+                       const std::vector<double>& prices, const std::vector<double>& volatility, const std::vector<double>& correlation)
+    : universe(tokens.size()), positions(positions.size()), slots(0) {
+    if (prices.size() != universe || volatility.size() != universe || correlation.size() != universe * universe) {
+        throw std::invalid_argument("Prices, volatility and correlation must cover every token.");
+    }
+    std::unordered_map<std::string, std::size_t> index;
+    for (std::size_t u = 0; u < universe; ++u) {
+        index[tokens[u]] = u;
+        log_spot.push_back(std::log(prices[u]));
+        sigma.push_back(volatility[u]);
+    }
+
+    cholesky.assign(universe * universe, 0.0);
+    for (std::size_t i = 0; i < universe; ++i) {
+        for (std::size_t j = 0; j <= i; ++j) {
+            double sum = correlation[i * universe + j];
+            for (std::size_t k = 0; k < j; ++k) {
+                sum -= cholesky[i * universe + k] * cholesky[j * universe + k];
+            }
+            if (i == j) {
+                if (sum <= 0.0) {
+                    throw std::invalid_argument("Correlation matrix must be positive definite.");
+                }
+                cholesky[i * universe + i] = std::sqrt(sum);
+            } else {
+                cholesky[i * universe + j] = sum / cholesky[j * universe + j];
+            }
+        }
+    }
+
+    for (const auto& position : positions) {
+        slots = std::max(slots, engine.pool(position.pool).get_tokens().size());
+    }
+    slot_token.assign(slots * this->positions, 0);
+    slot_weight.assign(slots * this->positions, 0.0);
+    log_scale.assign(this->positions, 0.0);
+    for (std::size_t p = 0; p < this->positions; ++p) {
+        const InfinityPool& pool = engine.pool(positions[p].pool);
+        if (!pool.is_initialized()) {
+            throw std::invalid_argument("Risk positions require pools with assigned weights.");
+        }
+        double log_k = 0.0;
+        double scale = std::log(positions[p].fraction);
+        const std::vector<std::string>& names = pool.get_tokens();
+        for (std::size_t t = 0; t < names.size(); ++t) {
+            auto u = index.find(names[t]);
+            if (u == index.end()) {
+                throw std::invalid_argument("Token " + names[t] + " has no price.");
+            }
+            double w = pool.get_weight(names[t]);
+            log_k += w * std::log(pool.get_balance(names[t]));
+            scale -= w * std::log(w);
+            slot_token[t * this->positions + p] = u->second;
+            slot_weight[t * this->positions + p] = w;
+        }
+        log_scale[p] = scale + log_k;
+    }
+}
+
+double RiskEngine::value(const std::vector<double>& log_prices) const {
+    std::vector<double> log_value(log_scale);
+    for (std::size_t j = 0; j < slots; ++j) {
+        const std::size_t* token = slot_token.data() + j * positions;
+        const double* weight = slot_weight.data() + j * positions;
+        double* out = log_value.data();
+        for (std::size_t p = 0; p < positions; ++p) {
+            out[p] += weight[p] * log_prices[token[p]];
+        }
+    }
+    double total = 0.0;
+    for (std::size_t p = 0; p < positions; ++p) {
+        total += std::exp(log_value[p]);
+    }
+    return total;
+}
+
+void RiskEngine::scenario_log_prices(std::mt19937_64& rng, const RiskConfig& config, std::vector<double>& z, std::vector<double>& out) const {
+    std::normal_distribution<double> normal;
+    for (auto& x : z) {
+        x = normal(rng);
+    }
+    const double root_h = std::sqrt(config.horizon);
+    for (std::size_t i = 0; i < universe; ++i) {
+        double shock = 0.0;
+        for (std::size_t k = 0; k <= i; ++k) {
+            shock += cholesky[i * universe + k] * z[k];
+        }
+        out[i] = log_spot[i] - 0.5 * sigma[i] * sigma[i] * config.horizon + sigma[i] * root_h * shock;
+    }
+}
+
+RiskReport RiskEngine::run(const RiskConfig& config) const {
+    if (config.scenarios == 0 || config.confidence <= 0.0 || config.confidence >= 1.0) {
+        throw std::invalid_argument("Risk run needs scenarios and a confidence in (0, 1).");
+    }
+    const double today = value(log_spot);
+    std::vector<double> losses(config.scenarios);
+
+    // scenarios are drawn in fixed blocks seeded by block index, so results
+    // do not depend on the thread count
+    const std::size_t block = 256;
+    const std::size_t blocks = (config.scenarios + block - 1) / block;
+    std::atomic<std::size_t> next_block(0);
+    auto worker = [&] {
+        std::vector<double> z(universe);
+        std::vector<double> log_prices(universe);
+        for (std::size_t b = next_block++; b < blocks; b = next_block++) {
+            std::mt19937_64 rng(config.seed * 0x9e3779b97f4a7c15ULL + b);
+            for (std::size_t s = b * block; s < std::min(config.scenarios, (b + 1) * block); ++s) {
+                scenario_log_prices(rng, config, z, log_prices);
+                losses[s] = today - value(log_prices);
+            }
+        }
+    };
+    std::size_t threads = config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for (std::size_t t = 1; t < std::min(threads, blocks); ++t) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    std::sort(losses.begin(), losses.end());
+    std::size_t cut = std::min(config.scenarios - 1, static_cast<std::size_t>(config.confidence * static_cast<double>(config.scenarios)));
+    double tail = 0.0;
+    for (std::size_t s = cut; s < config.scenarios; ++s) {
+        tail += losses[s];
+    }
+    return {today, losses[cut], tail / static_cast<double>(config.scenarios - cut)};
+}
+
+// REBALANCER
+
+struct RebalancePlan {
+    std::vector<SwapOp> swaps;
+    std::unordered_map<std::string, double> prices;             // pool-implied, in units of the numeraire
+    std::unordered_map<std::string, double> expected_holdings;  // after the swaps, at quoted prices
+    std::unordered_map<std::string, double> unfilled;           // value per token no pool could move
+};
+
+// A greedy pairwise planner for the swaps that move a portfolio to target
+// weights. It is not a joint optimizer: surplus tokens are paired with
+// deficit tokens largest first and each pair is traded directly, through the
+// pools holding both tokens, never along multi-hop routes; when every leg
+// fills, that takes at most (surpluses + deficits - 1) legs. Only the split
+// of a leg's input across its pools is optimized, in equal slices. A pool
+// pays b_out * (1 - r^e) for e = w_in / w_out, which is concave in the input
+// for e >= 1 and convex below it. Slices go greedily to whichever concave
+// pool pays the most for the next one, which is exact for those pools and
+// gives the best concave output for every slice count. Greedy allocation is
+// wrong for convex pools, and their best split can sit on a pool's balance
+// limit, so they get a knapsack over slice counts instead; the leg takes the
+// best combination of the two, exact to one slice.
+class PairwiseRebalancer {
+public:
+    explicit PairwiseRebalancer(PoolEngine& engine);
+
+    // prices come from pool spot prices, walked out from `numeraire`
+    RebalancePlan plan(const std::unordered_map<std::string, double>& holdings, const std::unordered_map<std::string, double>& target_weights,
+                       const std::string& numeraire, std::size_t slices = 64) const;
+
+    // runs every swap of the plan as one validated batch and returns the new holdings
+    std::unordered_map<std::string, double> execute(const RebalancePlan& plan, std::unordered_map<std::string, double> holdings);
+
+private:
+    PoolEngine& engine;
+
+    // planning only quotes, so it reads pools without marking them used
+    const PoolEngine& fleet() const;
+
+    std::unordered_map<std::string, double> implied_prices(const std::string& numeraire) const;
+
+    // adds the swaps for one leg to `plan` and returns the input they place
+    double plan_leg(RebalancePlan& plan, const std::string& t_in, const std::string& t_out, double amount_in, std::size_t slices) const;
+};
+
+PairwiseRebalancer::PairwiseRebalancer(PoolEngine& engine) : engine(engine) {}
+
+const PoolEngine& PairwiseRebalancer::fleet() const {
+    return engine;
+}
+
+std::unordered_map<std::string, double> PairwiseRebalancer::implied_prices(const std::string& numeraire) const {
+    std::unordered_map<std::string, double> prices = {{numeraire, 1.0}};
+    std::vector<std::string> frontier = {numeraire};
+    while (!frontier.empty()) {
+        // pools holding a frontier token, visited in id order as a full scan would
+        PoolBitmap reachable;
+        for (const auto& known : frontier) {
+            reachable |= fleet().token_index().pools_with(known);
+        }
+        std::vector<std::string> next;
+        for (std::size_t id : reachable.ids()) {
+            const InfinityPool& pool = fleet().pool(id);
+            if (!pool.is_initialized()) {
+                continue;
+            }
+            for (const auto& known : frontier) {
+                if (std::find(pool.get_tokens().begin(), pool.get_tokens().end(), known) == pool.get_tokens().end()) {
+                    continue;
+                }
+                for (const auto& token : pool.get_tokens()) {
+                    if (!prices.count(token)) {
+                        // one unit of token is worth spot(known, token) units of known at the margin
+                        prices[token] = prices[known] * pool.calculate_spot_price(known, token);
+                        next.push_back(token);
+                    }
+                }
+            }
+        }
+        frontier.swap(next);
+    }
+    return prices;
+}
+
+RebalancePlan PairwiseRebalancer::plan(const std::unordered_map<std::string, double>& holdings, const std::unordered_map<std::string, double>& target_weights,
+                               const std::string& numeraire, std::size_t slices) const {
+    if (slices == 0) {
+        throw std::invalid_argument("Rebalancing needs at least one slice per leg.");
+    }
+    RebalancePlan plan;
+    plan.prices = implied_prices(numeraire);
+    plan.expected_holdings = holdings;
+
+    double total = 0.0;
+    for (const auto& entry : holdings) {
+        auto price = plan.prices.find(entry.first);
+        if (price == plan.prices.end()) {
+            throw std::invalid_argument("No pool prices token " + entry.first + ".");
+        }
+        total += entry.second * price->second;
+    }
+    double weight_sum = 0.0;
+    for (const auto& entry : target_weights) {
+        if (entry.second < 0 || !plan.prices.count(entry.first)) {
+            throw std::invalid_argument("Invalid target weight for " + entry.first + ".");
+        }
+        weight_sum += entry.second;
+    }
+
+    // value to move out of (surplus) or into (deficit) each token
+    std::vector<std::pair<double, std::string>> surplus;
+    std::vector<std::pair<double, std::string>> deficit;
+    std::unordered_map<std::string, double> excess;
+    for (const auto& entry : holdings) {
+        excess[entry.first] += entry.second * plan.prices.at(entry.first);
+    }
+    for (const auto& entry : target_weights) {
+        excess[entry.first] -= total * entry.second / weight_sum;
+    }
+    for (const auto& entry : excess) {
+        if (entry.second > 1e-12 * total) {
+            surplus.push_back({entry.second, entry.first});
+        } else if (entry.second < -1e-12 * total) {
+            deficit.push_back({-entry.second, entry.first});
+        }
+    }
+    std::sort(surplus.rbegin(), surplus.rend());
+    std::sort(deficit.rbegin(), deficit.rend());
+
+    // every surplus is offered to the deficits in turn; a leg only moves
+    // what its pools can take, and whatever a surplus has left after the
+    // last deficit is reported as unfilled
+    const double dust = 1e-12 * total;
+    for (auto& source : surplus) {
+        const std::string& t_in = source.second;
+        const double price = plan.prices.at(t_in);
+        for (auto& sink : deficit) {
+            if (source.first <= dust) {
+                break;
+            }
+            if (sink.first <= dust) {
+                continue;
+            }
+            double value = std::min(source.first, sink.first);
+            double moved = plan_leg(plan, t_in, sink.second, value / price, slices) * price;
+            source.first -= moved;
+            sink.first -= moved;
+        }
+        if (source.first > dust) {
+            plan.unfilled[t_in] += source.first;
+        }
+    }
+    return plan;
+}
+
+double PairwiseRebalancer::plan_leg(RebalancePlan& plan, const std::string& t_in, const std::string& t_out, double amount_in, std::size_t slices) const {
+    std::vector<std::size_t> concave;
+    std::vector<std::size_t> convex;
+    for (std::size_t id : fleet().token_index().pools_with(t_in, t_out)) {
+        const InfinityPool& pool = fleet().pool(id);
+        if (pool.is_initialized()) {
+            (pool.get_weight(t_in) >= pool.get_weight(t_out) ? concave : convex).push_back(id);
+        }
+    }
+    auto quote = [&](std::size_t id, double amount) {
+        try {
+            return fleet().pool(id).quote_swap(t_in, t_out, amount);
+        } catch (const std::invalid_argument&) {
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+    };
+
+    // greedy over the concave pools: picks[k] takes slice k, and
+    // concave_out[k] is their total output for the first k slices
+    const double slice = amount_in / static_cast<double>(slices);
+    std::vector<std::size_t> count(concave.size());
+    std::vector<double> quoted(concave.size());
+    std::vector<std::size_t> picks;
+    std::vector<double> concave_out = {0.0};
+    while (picks.size() < slices && !concave.empty()) {
+        std::size_t best = concave.size();
+        double best_gain = 0.0;
+        double best_quote = 0.0;
+        for (std::size_t c = 0; c < concave.size(); ++c) {
+            double q = quote(concave[c], static_cast<double>(count[c] + 1) * slice);
+            if (q - quoted[c] > best_gain) {
+                best = c;
+                best_gain = q - quoted[c];
+                best_quote = q;
+            }
+        }
+        if (best == concave.size()) {
+            break;
+        }
+        ++count[best];
+        quoted[best] = best_quote;
+        picks.push_back(best);
+        concave_out.push_back(concave_out.back() + best_gain);
+    }
+
+    // convex[c] alone paid for m slices is quotes[m]; convex_out[j] is the
+    // most the convex pools pay for j slices, convex[c] taking take[c][j]
+    // of them once the pools before it are placed
+    const double unreachable = -std::numeric_limits<double>::infinity();
+    std::vector<double> convex_out(slices + 1, unreachable);
+    convex_out[0] = 0.0;
+    std::vector<std::vector<std::size_t>> take(convex.size(), std::vector<std::size_t>(slices + 1));
+    for (std::size_t c = 0; c < convex.size(); ++c) {
+        std::vector<double> quotes = {0.0};
+        for (std::size_t m = 1; m <= slices; ++m) {
+            double q = quote(convex[c], static_cast<double>(m) * slice);
+            if (!(q > 0.0)) {
+                break;
+            }
+            quotes.push_back(q);
+        }
+        std::vector<double> next = convex_out;
+        for (std::size_t j = 0; j <= slices; ++j) {
+            if (convex_out[j] == unreachable) {
+                continue;
+            }
+            for (std::size_t m = 1; m < quotes.size() && j + m <= slices; ++m) {
+                if (convex_out[j] + quotes[m] > next[j + m]) {
+                    next[j + m] = convex_out[j] + quotes[m];
+                    take[c][j + m] = m;
+                }
+            }
+        }
+        convex_out.swap(next);
+    }
+
+    // a split that places more of the leg always wins, since the rest
+    // would go unfilled; among equals the larger output does
+    std::size_t best_convex = 0;
+    std::size_t best_picks = picks.size();
+    double best_out = concave_out.back();
+    for (std::size_t j = 1; j <= slices; ++j) {
+        if (convex_out[j] == unreachable) {
+            continue;
+        }
+        std::size_t k = std::min(slices - j, picks.size());
+        double out = convex_out[j] + concave_out[k];
+        if (j + k > best_convex + best_picks || (j + k == best_convex + best_picks && out > best_out)) {
+            best_convex = j;
+            best_picks = k;
+            best_out = out;
+        }
+    }
+
+    std::fill(count.begin(), count.end(), 0);
+    for (std::size_t k = 0; k < best_picks; ++k) {
+        ++count[picks[k]];
+    }
+    auto place = [&](std::size_t id, std::size_t n) {
+        double allocated = static_cast<double>(n) * slice;
+        plan.swaps.push_back({id, t_in, t_out, allocated});
+        plan.expected_holdings[t_in] -= allocated;
+        plan.expected_holdings[t_out] += quote(id, allocated);
+    };
+    for (std::size_t c = 0; c < concave.size(); ++c) {
+        if (count[c] > 0) {
+            place(concave[c], count[c]);
+        }
+    }
+    for (std::size_t c = convex.size(), remaining = best_convex; c-- > 0;) {
+        std::size_t m = take[c][remaining];
+        if (m > 0) {
+            place(convex[c], m);
+            remaining -= m;
+        }
+    }
+    return static_cast<double>(best_convex + best_picks) * slice;
+}
+
+std::unordered_map<std::string, double> PairwiseRebalancer::execute(const RebalancePlan& plan, std::unordered_map<std::string, double> holdings) {
+    std::vector<double> amount_out = engine.execute_validated_swaps(plan.swaps);
+    for (std::size_t i = 0; i < plan.swaps.size(); ++i) {
+        if (!std::isnan(amount_out[i])) {
+            holdings[plan.swaps[i].t_in] -= plan.swaps[i].amount_in;
+            holdings[plan.swaps[i].t_out] += amount_out[i];
+        }
+    }
+    return holdings;
+}
+
+// WEIGHT SWEEP
+
+// price path: one vector of per-token prices per step, relative to step 0
+using PricePath = std::vector<std::vector<double>>;
+
+// correlated-free geometric Brownian paths starting at 1 for every token
+[[maybe_unused]] static std::vector<PricePath> simulate_price_paths(std::size_t tokens, std::size_t paths, std::size_t steps, double volatility, double dt,
+                                                                    std::uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::normal_distribution<double> normal;
+    std::vector<PricePath> out(paths, PricePath(steps + 1, std::vector<double>(tokens, 1.0)));
+    const double drift = -0.5 * volatility * volatility * dt;
+    const double shock = volatility * std::sqrt(dt);
+    for (auto& path : out) {
+        for (std::size_t s = 1; s <= steps; ++s) {
+            for (std::size_t t = 0; t < tokens; ++t) {
+                path[s][t] = path[s - 1][t] * std::exp(drift + shock * normal(rng));
+            }
+        }
+    }
+    return out;
+}
+
+struct WeightSweepConfig {
+    double step = 0.1;             // grid spacing on the weight simplex
+    double fee = 0.003;            // charged on arbitrage volume
+    std::size_t stage_paths = 16;  // paths evaluated between pruning rounds
+    double prune_sigmas = 3.0;     // standard errors by which a candidate must trail the best to be dropped
+    std::size_t threads = 0;       // 0 uses every hardware thread
+};
+
+struct WeightCandidate {
+    std::vector<double> weights;
+    double mean;        // fee income minus impermanent loss, per unit of initial value
+    double std_error;
+    std::size_t paths;  // evaluated before the candidate was pruned or the sweep ended
+    bool pruned;
+};
+
+// Fee income minus impermanent loss for a pool of unit initial value with
+// weights `w`, held along one path with arbitrageurs trading it to every
+// step's prices. The pool starts at the prices of step 0, as initialize()
+// does when deposits are proportional to the weights.
+static double evaluate_weights(const std::vector<double>& w, const PricePath& path, double fee) {
+    std::vector<double> balances(w.size());
+    double invariant = 1.0;
+    for (std::size_t t = 0; t < w.size(); ++t) {
+        balances[t] = w[t] / path[0][t];
+        invariant *= std::pow(balances[t], w[t]);
+    }
+    const std::vector<double> initial = balances;
+    double fees = 0.0;
+    for (std::size_t s = 1; s < path.size(); ++s) {
+        std::vector<double> next = arbitrage_balances(invariant, w, path[s]);
+        double volume = 0.0;
+        for (std::size_t t = 0; t < w.size(); ++t) {
+            volume += std::abs(next[t] - balances[t]) * path[s][t];
+        }
+        fees += fee * 0.5 * volume;
+        balances.swap(next);
+    }
+    double pool = 0.0;
+    double hold = 0.0;
+    for (std::size_t t = 0; t < w.size(); ++t) {
+        pool += balances[t] * path.back()[t];
+        hold += initial[t] * path.back()[t];
+    }
+    return fees - (hold - pool);
+}
+
+// appends every way of splitting `units` into `tokens` positive parts
+static void weight_grid(std::size_t units, std::size_t tokens, std::size_t used, std::vector<std::size_t>& parts, std::vector<WeightCandidate>& out) {
+    if (parts.size() + 1 == tokens) {
+        WeightCandidate c{std::vector<double>(tokens), 0.0, 0.0, 0, false};
+        for (std::size_t t = 0; t < parts.size(); ++t) {
+            c.weights[t] = static_cast<double>(parts[t]) / static_cast<double>(units);
+        }
+        c.weights.back() = static_cast<double>(units - used) / static_cast<double>(units);
+        out.push_back(c);
+        return;
+    }
+    const std::size_t still_needed = tokens - parts.size() - 1;
+    for (std::size_t part = 1; used + part + still_needed <= units; ++part) {
+        parts.push_back(part);
+        weight_grid(units, tokens, used + part, parts, out);
+        parts.pop_back();
+    }
+}
+
+// Evaluates every weight vector on the simplex grid against `paths` in
+// stages; after each stage, candidates whose upper confidence bound falls
+// below the best lower bound are dropped. Sorted best first.
+[[maybe_unused]] static std::vector<WeightCandidate> sweep_weights(std::size_t tokens, const std::vector<PricePath>& paths, const WeightSweepConfig& config) {
+    const std::size_t units = static_cast<std::size_t>(std::lround(1.0 / config.step));
+    if (tokens < 2 || units < tokens || paths.empty() || config.stage_paths == 0) {
+        throw std::invalid_argument("Sweep needs at least two tokens, a grid finer than 1/tokens and some paths.");
+    }
+
+    std::vector<WeightCandidate> candidates;
+    std::vector<std::size_t> parts;
+    weight_grid(units, tokens, 0, parts, candidates);
+
+    std::vector<double> sum(candidates.size());
+    std::vector<double> sum_sq(candidates.size());
+    std::size_t threads = config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+
+    for (std::size_t begin = 0; begin < paths.size(); begin += config.stage_paths) {
+        const std::size_t end = std::min(paths.size(), begin + config.stage_paths);
+        std::vector<std::size_t> live;
+        for (std::size_t c = 0; c < candidates.size(); ++c) {
+            if (!candidates[c].pruned) {
+                live.push_back(c);
+            }
+        }
+
+        std::atomic<std::size_t> next(0);
+        auto worker = [&] {
+            for (std::size_t i = next++; i < live.size(); i = next++) {
+                WeightCandidate& c = candidates[live[i]];
+                for (std::size_t p = begin; p < end; ++p) {
+                    double score = evaluate_weights(c.weights, paths[p], config.fee);
+                    sum[live[i]] += score;
+                    sum_sq[live[i]] += score * score;
+                }
+                c.paths = end;
+            }
+        };
+        std::vector<std::thread> pool;
+        for (std::size_t t = 1; t < std::min(threads, live.size()); ++t) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (auto& thread : pool) {
+            thread.join();
+        }
+
+        double best_lower = -std::numeric_limits<double>::infinity();
+        for (std::size_t c : live) {
+            double n = static_cast<double>(candidates[c].paths);
+            candidates[c].mean = sum[c] / n;
+            double variance = n > 1 ? std::max(0.0, (sum_sq[c] - n * candidates[c].mean * candidates[c].mean) / (n - 1)) : 0.0;
+            candidates[c].std_error = std::sqrt(variance / n);
+            best_lower = std::max(best_lower, candidates[c].mean - config.prune_sigmas * candidates[c].std_error);
+        }
+        for (std::size_t c : live) {
+            candidates[c].pruned = candidates[c].mean + config.prune_sigmas * candidates[c].std_error < best_lower;
+        }
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const WeightCandidate& a, const WeightCandidate& b) {
+        return a.pruned != b.pruned ? !a.pruned : a.mean > b.mean;
+    });
+    return candidates;
+}
+
+// FLASH ACCOUNTING
+
+// A multi-pool transaction. Every swap is priced against the pool's balances
+// plus the deltas of earlier swaps in the same transaction, but nothing is
+// written until commit(), which applies each touched pool's net deltas and
+// recomputes its invariant once. Deltas are kept in flat lists, since a route
+// touches only a handful of (pool, token) pairs, and their capacity is reused
+// by the next transaction. Each pool delta holds a pointer to the confirmed
+// balance it settles into, resolved by the swap that created it, so the
+// engine must not be changed while a transaction is open.
+class FlashTransaction {
+public:
+    explicit FlashTransaction(PoolEngine& engine);
+
+    // same checks and result as InfinityPool::swap() on the pending state
+    double swap(std::size_t pool, const std::string& t_in, const std::string& t_out, double amount_in);
+
+    // balance of `token` in `pool` as seen inside the transaction
+    double balance(std::size_t pool, const std::string& token) const;
+
+    // what the trader pays (positive) or receives (negative) per token;
+    // intermediate tokens of a route net out to zero
+    std::unordered_map<std::string, double> net() const;
+
+    std::size_t touched_pools() const;
+
+    // Settles every touched pool and starts a new, empty transaction. Throws
+    // without changing any pool if one would be left with a negative balance.
+    void commit();
+
+    void rollback();
+
+private:
+    struct PoolDelta {
+        std::size_t pool;
+        double* balance;
+        double amount;
+    };
+
+    PoolEngine& engine;
+    std::vector<PoolDelta> pool_deltas;
+    std::vector<std::pair<std::string, double>> trader_deltas;
+
+    const InfinityPool& confirmed(std::size_t pool) const;
+
+    // sum of the deltas on one confirmed balance
+    double pending(const double* balance) const;
+
+    void add_pool_delta(std::size_t pool, double* balance, double amount);
+
+    void add_trader_delta(const std::string& token, double amount);
+};
+
+FlashTransaction::FlashTransaction(PoolEngine& engine) : engine(engine) {}
+
+const InfinityPool& FlashTransaction::confirmed(std::size_t pool) const {
+    const PoolEngine& e = engine;
+    return e.pool(pool);
+}
+
+double FlashTransaction::pending(const double* balance) const {
+    for (const auto& delta : pool_deltas) {
+        if (delta.balance == balance) {
+            return delta.amount;
+        }
+    }
+    return 0.0;
+}
+
+void FlashTransaction::add_pool_delta(std::size_t pool, double* balance, double amount) {
+    for (auto& delta : pool_deltas) {
+        if (delta.balance == balance) {
+            delta.amount += amount;
+            return;
+        }
+    }
+    pool_deltas.push_back({pool, balance, amount});
+}
+
+void FlashTransaction::add_trader_delta(const std::string& token, double amount) {
+    for (auto& delta : trader_deltas) {
+        if (delta.first == token) {
+            delta.second += amount;
+            return;
+        }
+    }
+    trader_deltas.emplace_back(token, amount);
+}
+
+double FlashTransaction::balance(std::size_t pool, const std::string& token) const {
+    const InfinityPool& p = confirmed(pool);
+    double b = p.get_balance(token);
+    return b + pending(&p.balances.find(token)->second);
+}
+
+double FlashTransaction::swap(std::size_t pool, const std::string& t_in, const std::string& t_out, double amount_in) {
+    InfinityPool& p = engine.pool(pool);
+    if (p.weights.empty()) {
+        throw std::invalid_argument("Swapping is not allowed until weights are assigned.");
+    }
+
+    if (amount_in <= 0) {
+        throw std::invalid_argument("Amount in must be positive.");
+    }
+
+    auto w_in = p.weights.find(t_in);
+    auto w_out = p.weights.find(t_out);
+    if (w_in == p.weights.end() || w_out == p.weights.end()) {
+        throw std::invalid_argument("Invalid token indices.");
+    }
+
+    double* confirmed_in = &p.balances.find(t_in)->second;
+    double* confirmed_out = &p.balances.find(t_out)->second;
+    double b_in = *confirmed_in + pending(confirmed_in);
+    double b_out = *confirmed_out + pending(confirmed_out);
+    if (b_in < amount_in) {
+        throw std::invalid_argument("Insufficient balance for the input token.");
+    }
+
+    double amount_out = p.swap_output(b_in, b_out, w_in->second, w_out->second, amount_in);
+    add_pool_delta(pool, confirmed_in, -amount_in);
+    add_pool_delta(pool, confirmed_out, amount_out);
+    add_trader_delta(t_in, amount_in);
+    add_trader_delta(t_out, -amount_out);
+    return amount_out;
+}
+
+std::unordered_map<std::string, double> FlashTransaction::net() const {
+    return std::unordered_map<std::string, double>(trader_deltas.begin(), trader_deltas.end());
+}
+
+std::size_t FlashTransaction::touched_pools() const {
+    std::vector<std::size_t> ids;
+    for (const auto& delta : pool_deltas) {
+        ids.push_back(delta.pool);
+    }
+    std::sort(ids.begin(), ids.end());
+    return std::unique(ids.begin(), ids.end()) - ids.begin();
+}
+
+void FlashTransaction::commit() {
+    for (const auto& delta : pool_deltas) {
+        if (*delta.balance + delta.amount < 0) {
+            throw std::invalid_argument("Transaction would leave pool " + std::to_string(delta.pool) + " with a negative balance.");
+        }
+    }
+
+    // each (pool, token) has one delta, so grouping by pool cannot reorder
+    // additions to the same balance; every pool is then settled in one run
+    std::sort(pool_deltas.begin(), pool_deltas.end(), [](const PoolDelta& a, const PoolDelta& b) { return a.pool < b.pool; });
+    for (std::size_t i = 0; i < pool_deltas.size();) {
+        std::size_t id = pool_deltas[i].pool;
+        for (; i < pool_deltas.size() && pool_deltas[i].pool == id; ++i) {
+            *pool_deltas[i].balance += pool_deltas[i].amount;
+        }
+        engine.pool(id).set_invariant();
+    }
+    rollback();
+}
+
+void FlashTransaction::rollback() {
+    pool_deltas.clear();
+    trader_deltas.clear();
+}
+
+// STRIPED POOL
+
+// Concurrent front end for one wide pool. A swap reads and writes only its
+// two tokens' balances and weights never change, so every token has its own
+// lock, taken in index order, and swaps on disjoint pairs run in parallel.
+// The invariant is kept as sum(w_t * log b_t) in an atomic that each swap
+// moves by its own two terms, instead of set_invariant()'s pass over every
+// token.
+class StripedPool {
+public:
+    // copies the state of an initialized pool
+    explicit StripedPool(const InfinityPool& pool);
+
+    StripedPool(const StripedPool&) = delete;
+
+    StripedPool& operator=(const StripedPool&) = delete;
+
+    // same checks and result as InfinityPool::swap(); safe to call concurrently
+    double swap(const std::string& t_in, const std::string& t_out, double amount_in);
+
+    double get_balance(const std::string& token) const;
+
+    double get_invariant() const;
+
+    // The current state as a regular pool; takes every lock. Its version is
+    // the copied pool's plus the number of swaps committed since, so two
+    // snapshots share a version only if they share a state.
+    InfinityPool snapshot() const;
+
+private:
+    // one cache line per token so neighbouring locks do not contend
+    struct alignas(64) Slot {
+        mutable std::mutex lock;
+        double balance = 0.0;
+        double weight = 0.0;
+    };
+
+    InfinityPool base;
+    std::unordered_map<std::string, std::size_t> index;
+    std::vector<Slot> slots;
+    std::atomic<double> log_invariant;
+
+    // committed swaps, bumped under the swap's locks
+    std::atomic<std::uint64_t> mutations;
+
+    std::size_t slot(const std::string& token) const;
+};
+
+StripedPool::StripedPool(const InfinityPool& pool) : base(pool), slots(pool.tokens.size()), log_invariant(0.0), mutations(0) {
+    if (pool.weights.empty()) {
+        throw std::invalid_argument("Striping is not allowed until weights are assigned.");
+    }
+
+    double log_sum = 0.0;
+    for (std::size_t t = 0; t < pool.tokens.size(); ++t) {
+        index[pool.tokens[t]] = t;
+        slots[t].balance = pool.balances.at(pool.tokens[t]);
+        slots[t].weight = pool.weights.at(pool.tokens[t]);
+        log_sum += slots[t].weight * std::log(slots[t].balance);
+    }
+    log_invariant.store(log_sum);
+}
+
+std::size_t StripedPool::slot(const std::string& token) const {
+    auto t = index.find(token);
+    if (t == index.end()) {
+        throw std::invalid_argument("Invalid token indices.");
+    }
+    return t->second;
+}
+
+double StripedPool::swap(const std::string& t_in, const std::string& t_out, double amount_in) {
+    if (amount_in <= 0) {
+        throw std::invalid_argument("Amount in must be positive.");
+    }
+
+    Slot& in = slots[slot(t_in)];
+    Slot& out = slots[slot(t_out)];
+    std::unique_lock<std::mutex> first((&in < &out ? in : out).lock);
+    std::unique_lock<std::mutex> second;
+    if (&in != &out) {
+        second = std::unique_lock<std::mutex>((&in < &out ? out : in).lock);
+    }
+
+    if (in.balance < amount_in) {
+        throw std::invalid_argument("Insufficient balance for the input token.");
+    }
+
+    double amount_out = base.swap_output(in.balance, out.balance, in.weight, out.weight, amount_in);
+    double log_before = in.weight * std::log(in.balance) + (&in != &out ? out.weight * std::log(out.balance) : 0.0);
+    in.balance -= amount_in;
+    out.balance += amount_out;
+    double log_after = in.weight * std::log(in.balance) + (&in != &out ? out.weight * std::log(out.balance) : 0.0);
+
+    double delta = log_after - log_before;
+    double current = log_invariant.load(std::memory_order_relaxed);
+    while (!log_invariant.compare_exchange_weak(current, current + delta, std::memory_order_relaxed)) {
+    }
+    mutations.fetch_add(1, std::memory_order_relaxed);
+    return amount_out;
+}
+
+double StripedPool::get_balance(const std::string& token) const {
+    const Slot& s = slots[slot(token)];
+    std::lock_guard<std::mutex> lock(s.lock);
+    return s.balance;
+}
+
+double StripedPool::get_invariant() const {
+    return std::exp(log_invariant.load(std::memory_order_relaxed));
+}
+
+InfinityPool StripedPool::snapshot() const {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(slots.size());
+    for (const auto& s : slots) {
+        locks.emplace_back(s.lock);
+    }
+
+    InfinityPool pool = base;
+    for (std::size_t t = 0; t < slots.size(); ++t) {
+        pool.balances[pool.tokens[t]] = slots[t].balance;
+    }
+    pool.set_invariant();
+    pool.version = base.version + mutations.load(std::memory_order_relaxed);
+    return pool;
+}
+
+// MEMPOOL
+
+// Pending swaps pre-executed on an overlay over the engine's confirmed
+// state, so a block built from them is mostly computed before it is
+// produced. Each touched pool keeps the pending balances of the tokens its
+// swaps moved and the ids of those swaps in arrival order; untouched state
+// is read through to the engine. Dropping a swap replays only the later
+// swaps on its pool. The engine must not be changed while swaps are pending.
+class Mempool {
+public:
+    explicit Mempool(PoolEngine& engine);
+
+    // pre-executes `op` after every pending swap and returns its id
+    std::size_t submit(const SwapOp& op);
+
+    // the speculative amount out of a pending swap; NaN if it is invalid
+    // against the pending state or was dropped
+    double result(std::size_t id) const;
+
+    void drop(std::size_t id);
+
+    std::size_t pending() const;
+
+    // Writes the overlay into the engine and recomputes each touched pool's
+    // invariant once, giving the state and results execute_block() would on
+    // the live swaps in arrival order. Returns results by id (NaN for
+    // dropped swaps) and starts ids again from zero.
+    std::vector<double> commit();
+
+private:
+    struct PendingSwap {
+        SwapOp op;
+        double amount_out;
+        bool live;
+        // pending balances of t_in and t_out before the swap ran, to undo it
+        double before_in;
+        double before_out;
+    };
+
+    struct PoolOverlay {
+        std::vector<std::size_t> swaps;
+        std::vector<std::pair<std::string, double>> balances;
+    };
+
+    PoolEngine& engine;
+    std::vector<PendingSwap> swaps;
+    std::unordered_map<std::size_t, PoolOverlay> overlays;
+    std::size_t live_count = 0;
+
+    // runs swap `id` on its pool's overlay and records its result
+    void execute(std::size_t id, PoolOverlay& overlay);
+
+    double* overlay_balance(PoolOverlay& overlay, const InfinityPool& p, const std::string& token);
+};
+
+Mempool::Mempool(PoolEngine& engine) : engine(engine) {}
+
+// the pending balance entry of `token`, created from the confirmed balance
+// on first use; null if the pool has no such token
+double* Mempool::overlay_balance(PoolOverlay& overlay, const InfinityPool& p, const std::string& token) {
+    for (auto& balance : overlay.balances) {
+        if (balance.first == token) {
+            return &balance.second;
+        }
+    }
+    auto b = p.balances.find(token);
+    if (b == p.balances.end()) {
+        return nullptr;
+    }
+    overlay.balances.emplace_back(token, b->second);
+    return &overlay.balances.back().second;
+}
+
+void Mempool::execute(std::size_t id, PoolOverlay& overlay) {
+    PendingSwap& pending = swaps[id];
+    const SwapOp& op = pending.op;
+    const PoolEngine& confirmed = engine;
+    const InfinityPool& p = confirmed.pool(op.pool);
+    pending.amount_out = std::numeric_limits<double>::quiet_NaN();
+
+    auto w_in = p.weights.find(op.t_in);
+    auto w_out = p.weights.find(op.t_out);
+    if (w_in == p.weights.end() || w_out == p.weights.end() || op.t_in == op.t_out || !(op.amount_in > 0)) {
+        return;
+    }
+
+    double* b_out = overlay_balance(overlay, p, op.t_out);
+    double* b_in = overlay_balance(overlay, p, op.t_in);
+    if (b_out == nullptr || b_in == nullptr || *b_in < op.amount_in) {
+        return;
+    }
+    // adding b_in's entry may have moved b_out's
+    b_out = overlay_balance(overlay, p, op.t_out);
+
+    double out = p.swap_output(*b_in, *b_out, w_in->second, w_out->second, op.amount_in);
+    pending.before_in = *b_in;
+    pending.before_out = *b_out;
+    *b_in -= op.amount_in;
+    *b_out += out;
+    pending.amount_out = out;
+}
+
+std::size_t Mempool::submit(const SwapOp& op) {
+    const std::size_t id = swaps.size();
+    swaps.push_back({op, std::numeric_limits<double>::quiet_NaN(), true, 0.0, 0.0});
+    ++live_count;
+    if (op.pool < engine.size()) {
+        PoolOverlay& overlay = overlays[op.pool];
+        overlay.swaps.push_back(id);
+        execute(id, overlay);
+    }
+    return id;
+}
+
+double Mempool::result(std::size_t id) const {
+    const PendingSwap& pending = swaps.at(id);
+    return pending.live ? pending.amount_out : std::numeric_limits<double>::quiet_NaN();
+}
+
+void Mempool::drop(std::size_t id) {
+    PendingSwap& pending = swaps.at(id);
+    if (!pending.live) {
+        return;
+    }
+    pending.live = false;
+    --live_count;
+
+    auto overlay = overlays.find(pending.op.pool);
+    if (overlay == overlays.end()) {
+        return;
+    }
+    PoolOverlay& o = overlay->second;
+    const PoolEngine& confirmed = engine;
+    const InfinityPool& p = confirmed.pool(pending.op.pool);
+
+    // undo the dropped swap and every later one on the pool, newest first,
+    // then replay the later ones without it
+    const std::size_t at = std::find(o.swaps.begin(), o.swaps.end(), id) - o.swaps.begin();
+    for (std::size_t k = o.swaps.size(); k-- > at;) {
+        const PendingSwap& undo = swaps[o.swaps[k]];
+        if (!std::isnan(undo.amount_out)) {
+            *overlay_balance(o, p, undo.op.t_in) = undo.before_in;
+            *overlay_balance(o, p, undo.op.t_out) = undo.before_out;
+        }
+    }
+    pending.amount_out = std::numeric_limits<double>::quiet_NaN();
+    o.swaps.erase(o.swaps.begin() + at);
+    for (std::size_t k = at; k < o.swaps.size(); ++k) {
+        execute(o.swaps[k], o);
+    }
+}
+
+std::size_t Mempool::pending() const {
+    return live_count;
+}
+
+std::vector<double> Mempool::commit() {
+    std::vector<double> amount_out(swaps.size());
+    for (std::size_t id = 0; id < swaps.size(); ++id) {
+        amount_out[id] = result(id);
+    }
+
+    for (auto& entry : overlays) {
+        const auto& ids = entry.second.swaps;
+        if (std::all_of(ids.begin(), ids.end(), [this](std::size_t id) { return std::isnan(swaps[id].amount_out); })) {
+            continue;
+        }
+        InfinityPool& p = engine.pool(entry.first);
+        for (const auto& balance : entry.second.balances) {
+            p.balances.find(balance.first)->second = balance.second;
+        }
+        p.set_invariant();
+    }
+
+    swaps.clear();
+    overlays.clear();
+    live_count = 0;
+    return amount_out;
+}
+
+// ROUTER
+
+struct RouteHop {
+    std::size_t pool;
+    std::string t_in;
+    std::string t_out;
+};
+
+// no hops when there is no route
+struct Route {
+    std::vector<RouteHop> hops;
+    double amount_out = 0.0;
+};
+
+// Best-output path search over the engine's initialized pools, up to
+// max_hops swaps long and never revisiting a token. Candidate pools for
+// each hop come from the token index.
+class Router {
+public:
+    explicit Router(const PoolEngine& engine, std::size_t max_hops = 3);
+
+    Route best_route(const std::string& source, const std::string& destination, double amount_in) const;
+
+    // the output of `route` for `amount_in` now; NaN if a hop would be rejected
+    double quote(const Route& route, double amount_in) const;
+
+    const PoolEngine& pools() const;
+
+private:
+    const PoolEngine& engine;
+    std::size_t max_hops;
+
+    void search(const std::string& token, const std::string& destination, double amount, std::vector<RouteHop>& path, Route& best) const;
+
+    // quote_swap(), or NaN where it would throw
+    double hop_output(const InfinityPool& pool, const std::string& t_in, const std::string& t_out, double amount_in) const;
+};
+
+Router::Router(const PoolEngine& engine, std::size_t max_hops) : engine(engine), max_hops(max_hops) {}
+
+const PoolEngine& Router::pools() const {
+    return engine;
+}
+
+double Router::hop_output(const InfinityPool& pool, const std::string& t_in, const std::string& t_out, double amount_in) const {
+    if (!pool.is_initialized() || !(amount_in > 0) || amount_in > pool.get_balance(t_in)) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    return pool.quote_swap(t_in, t_out, amount_in);
+}
+
+void Router::search(const std::string& token, const std::string& destination, double amount, std::vector<RouteHop>& path, Route& best) const {
+    if (path.size() == max_hops) {
+        return;
+    }
+    for (std::size_t id : engine.token_index().pools_with(token).ids()) {
+        const InfinityPool& pool = engine.pool(id);
+        for (const auto& next : pool.get_tokens()) {
+            bool visited = next == token || std::any_of(path.begin(), path.end(), [&next](const RouteHop& hop) { return hop.t_in == next; });
+            if (visited) {
+                continue;
+            }
+            double out = hop_output(pool, token, next, amount);
+            if (std::isnan(out)) {
+                continue;
+            }
+            path.push_back({id, token, next});
+            if (next == destination) {
+                if (best.hops.empty() || out > best.amount_out) {
+                    best.hops = path;
+                    best.amount_out = out;
+                }
+            } else {
+                search(next, destination, out, path, best);
+            }
+            path.pop_back();
+        }
+    }
+}
+
+Route Router::best_route(const std::string& source, const std::string& destination, double amount_in) const {
+    if (amount_in <= 0) {
+        throw std::invalid_argument("Amount in must be positive.");
+    }
+
+    Route best;
+    std::vector<RouteHop> path;
+    if (source != destination) {
+        search(source, destination, amount_in, path, best);
+    }
+    return best;
+}
+
+double Router::quote(const Route& route, double amount_in) const {
+    double amount = amount_in;
+    for (const auto& hop : route.hops) {
+        amount = hop_output(engine.pool(hop.pool), hop.t_in, hop.t_out, amount);
+        if (std::isnan(amount)) {
+            break;
+        }
+    }
+    return amount;
+}
+
+// Best routes per (source, destination, power-of-two size bucket), each
+// stored with the versions of the pools it goes through. A hit whose pools
+// are all unchanged is re-quoted for the exact amount instead of searched
+// again; any version change on the route recomputes it. Changes to pools off
+// the route do not invalidate it, so a hit can miss a route that has just
+// become better.
+class RouteCache {
+public:
+    explicit RouteCache(const Router& router);
+
+    Route best_route(const std::string& source, const std::string& destination, double amount_in);
+
+    std::size_t hits() const;
+
+    std::size_t misses() const;
+
+private:
+    struct Entry {
+        Route route;
+        std::vector<std::uint64_t> versions;
+    };
+
+    const Router& router;
+    std::map<std::tuple<std::string, std::string, int>, Entry> entries;
+    std::size_t hit_count = 0;
+    std::size_t miss_count = 0;
+};
+
+RouteCache::RouteCache(const Router& router) : router(router) {}
+
+Route RouteCache::best_route(const std::string& source, const std::string& destination, double amount_in) {
+    if (amount_in <= 0) {
+        throw std::invalid_argument("Amount in must be positive.");
+    }
+
+    const PoolEngine& engine = router.pools();
+    Entry& entry = entries[std::make_tuple(source, destination, std::ilogb(amount_in))];
+    bool fresh = !entry.route.hops.empty() && entry.versions.size() == entry.route.hops.size();
+    for (std::size_t h = 0; fresh && h < entry.route.hops.size(); ++h) {
+        fresh = engine.pool(entry.route.hops[h].pool).get_version() == entry.versions[h];
+    }
+    if (fresh) {
+        Route route = entry.route;
+        route.amount_out = router.quote(route, amount_in);
+        // a size near the top of the bucket can fail a hop the cached size passed
+        if (!std::isnan(route.amount_out)) {
+            ++hit_count;
+            return route;
+        }
+    }
+
+    ++miss_count;
+    entry.route = router.best_route(source, destination, amount_in);
+    entry.versions.clear();
+    for (const auto& hop : entry.route.hops) {
+        entry.versions.push_back(engine.pool(hop.pool).get_version());
+    }
+    return entry.route;
+}
+
+std::size_t RouteCache::hits() const {
+    return hit_count;
+}
+
+std::size_t RouteCache::misses() const {
+    return miss_count;
+}
+
+#ifdef INFINITY_POOL_BENCH
+
+// BENCHMARKS
+// build with -DINFINITY_POOL_BENCH, run as `infinity_pool <mode> [args...]`
+
+// every global allocation in the bench build is counted, so any code path
+// can be checked for heap traffic
+static std::atomic<std::size_t> bench_alloc_count(0);
+static std::atomic<std::size_t> bench_alloc_bytes(0);
+
+void* operator new(std::size_t size) {
+    bench_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    bench_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    bench_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    bench_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t& tag) noexcept {
+    return operator new(size, tag);
+}
+
+// over-aligned types (StripedPool's slots) come through these; aligned_alloc
+// wants a size that is a multiple of the alignment
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    bench_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    bench_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+    auto alignment = static_cast<std::size_t>(align);
+    return std::aligned_alloc(alignment, (std::max<std::size_t>(size, 1) + alignment - 1) / alignment * alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t& tag) noexcept {
+    return operator new(size, align, tag);
+}
+
+void* operator new(std::size_t size, std::align_val_t align) {
+    if (void* p = operator new(size, align, std::nothrow)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+// GCC pairs the inlined free() with the replaced operator new and warns
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+struct AllocStats {
+    double allocs_per_call;
+    double bytes_per_call;
+};
+
+// `setup` runs outside the counted window, `call` inside it
+template <typename Setup, typename Call>
+static AllocStats bench_allocations(std::size_t calls, Setup&& setup, Call&& call) {
+    std::size_t count = 0;
+    std::size_t bytes = 0;
+    // one untracked call first so lazily built per-pool state (token rows)
+    // is charged to warmup, not to the steady state being reported
+    setup();
+    call();
+    for (std::size_t i = 0; i < calls; ++i) {
+        setup();
+        std::size_t count_before = bench_alloc_count.load(std::memory_order_relaxed);
+        std::size_t bytes_before = bench_alloc_bytes.load(std::memory_order_relaxed);
+        call();
+        count += bench_alloc_count.load(std::memory_order_relaxed) - count_before;
+        bytes += bench_alloc_bytes.load(std::memory_order_relaxed) - bytes_before;
+    }
+    return {static_cast<double>(count) / static_cast<double>(calls), static_cast<double>(bytes) / static_cast<double>(calls)};
+}
+
+// hardware counters for the calling thread via perf_event_open; events the
+// kernel refuses (no PMU, perf_event_paranoid) are reported as unavailable
+class PerfCounters {
+public:
+    PerfCounters();
+
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    void start();
+
+    void stop();
+
+    // counts since start(), -1 for unavailable events
+    std::vector<long long> read() const;
+
+    const std::vector<const char*>& names() const { return events; }
+
+private:
+    std::vector<const char*> events;
+    std::vector<int> fds;
+};
+
+#if defined(__linux__)
+
+static int perf_open(std::uint32_t type, std::uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+PerfCounters::PerfCounters() {
+    const std::uint64_t l1d_read_miss = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    events = {"cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses"};
+    fds = {perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES), perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+           perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES), perf_open(PERF_TYPE_HW_CACHE, l1d_read_miss),
+           perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES)};
+}
+
+PerfCounters::~PerfCounters() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+void PerfCounters::start() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void PerfCounters::stop() {
+    for (int fd : fds) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+}
+
+std::vector<long long> PerfCounters::read() const {
+    std::vector<long long> values;
+    for (int fd : fds) {
+        long long value = -1;
+        if (fd < 0 || ::read(fd, &value, sizeof(value)) != static_cast<ssize_t>(sizeof(value))) {
+            value = -1;
+        }
+        values.push_back(value);
+    }
+    return values;
+}
+
+#else
+
+PerfCounters::PerfCounters() {}
+
+PerfCounters::~PerfCounters() {}
+
+void PerfCounters::start() {}
+
+void PerfCounters::stop() {}
+
+std::vector<long long> PerfCounters::read() const {
+    return {};
+}
+
+#endif
+
+static std::vector<std::string> bench_tokens() {
+    return {"X", "Y", "Z"};
+}
+
+static void bench_fill_engine(PoolEngine& engine, std::size_t fleet, std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> balance(1.0, 1000.0);
+    std::vector<std::string> tokens = bench_tokens();
+    for (std::size_t i = 0; i < fleet; ++i) {
+        std::size_t id = engine.add_pool(tokens);
+        std::unordered_map<std::string, double> amount_in;
+        for (const auto& token : tokens) {
+            amount_in[token] = balance(rng);
+        }
+        engine.pool(id).initialize(amount_in);
+        engine.pool(id).set_invariant();
+    }
+}
+
+static std::vector<SwapOp> bench_swap_ops(std::size_t fleet, std::size_t count, std::mt19937_64& rng) {
+    std::vector<std::string> tokens = bench_tokens();
+    std::uniform_int_distribution<std::size_t> pool(0, fleet - 1);
+    std::uniform_int_distribution<std::size_t> token(0, tokens.size() - 1);
+    std::vector<SwapOp> ops;
+    ops.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        std::size_t t_in = token(rng);
+        std::size_t t_out = (t_in + 1 + token(rng) % (tokens.size() - 1)) % tokens.size();
+        ops.push_back({pool(rng), tokens[t_in], tokens[t_out], 1e-6});
+    }
+    return ops;
+}
+
+template <typename F>
+static double bench_ns_per_op(std::size_t ops, F&& run) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    auto stop = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(stop - start).count() / static_cast<double>(ops);
+}
+
+// naive vs prefetch-pipelined batch swaps over a fleet that does not fit in LLC
+static int bench_prefetch(std::size_t fleet, std::size_t count) {
+    std::mt19937_64 rng(76);
+    PoolEngine engine;
+    bench_fill_engine(engine, fleet, rng);
+    std::vector<SwapOp> ops = bench_swap_ops(fleet, count, rng);
+
+    // both paths must give the same results and leave the same balances
+    PoolEngine reference = engine;
+    std::vector<double> expected = reference.execute_swaps(ops);
+    std::vector<double> actual = engine.execute_swaps_prefetched(ops);
+    std::size_t mismatches = expected != actual;
+    for (std::size_t id = 0; id < fleet; ++id) {
+        for (const auto& token : engine.pool(id).get_tokens()) {
+            mismatches += engine.pool(id).get_balance(token) != reference.pool(id).get_balance(token);
+        }
+    }
+
+    double sink = 0.0;
+    for (int round = 0; round < 3; ++round) {
+        double naive = bench_ns_per_op(count, [&] { sink += engine.execute_swaps(ops).back(); });
+        double prefetched = bench_ns_per_op(count, [&] { sink += engine.execute_swaps_prefetched(ops).back(); });
+        std::cout << "prefetch fleet=" << fleet << " ops=" << count << " naive=" << naive << "ns/op prefetched=" << prefetched
+                  << "ns/op speedup=" << naive / prefetched << std::endl;
+    }
+    std::cout << "prefetch mismatches=" << mismatches << std::endl;
+    return sink == 0.0 || mismatches != 0;
+}
+
+// exception-driven rejection vs mask-driven rejection on a spam-heavy batch
+static int bench_validate(std::size_t fleet, std::size_t count, double spam) {
+    std::mt19937_64 rng(77);
+    PoolEngine engine;
+    bench_fill_engine(engine, fleet, rng);
+    std::vector<SwapOp> ops = bench_swap_ops(fleet, count, rng);
+    std::bernoulli_distribution is_spam(spam);
+    for (auto& op : ops) {
+        if (is_spam(rng)) {
+            op.amount_in = (rng() & 1) ? -1.0 : 1e12;
+        }
+    }
+
+    std::size_t rejected = 0;
+    double sink = 0.0;
+    double naive = bench_ns_per_op(count, [&] {
+        for (const auto& op : ops) {
+            try {
+                sink += engine.pool(op.pool).swap(op.t_in, op.t_out, op.amount_in);
+            } catch (const std::invalid_argument&) {
+                ++rejected;
+            }
+        }
+    });
+    double masked = bench_ns_per_op(count, [&] { sink += engine.execute_validated_swaps(ops).size(); });
+    std::cout << "validate fleet=" << fleet << " ops=" << count << " spam=" << spam << " rejected=" << rejected
+              << " exceptions=" << naive << "ns/op masked=" << masked << "ns/op" << std::endl;
+    return sink == 0.0;
+}
+
+static void bench_print_footprint(const char* label, const EngineFootprint& f, std::size_t fleet) {
+    std::cout << label << " total=" << f.total() << "B pools=" << f.pools << "B table=" << f.pool_table << "B scratch=" << f.scratch
+              << "B per_pool=" << static_cast<double>(f.total()) / static_cast<double>(fleet) << "B" << std::endl;
+}
+
+// per-pool breakdown and the effect of compaction on a mostly idle fleet
+static int bench_footprint(std::size_t fleet, std::size_t count) {
+    std::mt19937_64 rng(78);
+    PoolEngine engine;
+    bench_fill_engine(engine, fleet, rng);
+    PoolFootprint p = engine.pool(0).memory_footprint();
+    std::cout << "pool object=" << p.object << "B tokens=" << p.tokens << "B weights=" << p.weights << "B balances=" << p.balances
+              << "B total=" << p.total() << "B" << std::endl;
+
+    engine.execute_validated_swaps(bench_swap_ops(fleet, count, rng));
+    bench_print_footprint("before", engine.memory_footprint(), fleet);
+    std::size_t reclaimed = engine.compact();
+    bench_print_footprint("after ", engine.memory_footprint(), fleet);
+    std::cout << "reclaimed=" << reclaimed << "B" << std::endl;
+    return 0;
+}
+
+// memory per pool and touch cost with a small hot set over a large fleet
+static int bench_tiering(std::size_t fleet, std::size_t hot, std::size_t count) {
+    std::mt19937_64 rng(79);
+    std::uniform_real_distribution<double> balance(1.0, 1000.0);
+    std::vector<std::string> tokens = bench_tokens();
+    TieredPoolStore store(hot);
+    for (std::size_t i = 0; i < fleet; ++i) {
+        InfinityPool pool(tokens);
+        pool.initialize({{"X", balance(rng)}, {"Y", balance(rng)}, {"Z", balance(rng)}});
+        pool.set_invariant();
+        store.add(pool);
+    }
+
+    // a hot working set of `hot` pools with 5% of touches going anywhere
+    std::uniform_int_distribution<std::size_t> any(0, fleet - 1);
+    std::uniform_int_distribution<std::size_t> working(0, hot - 1);
+    std::bernoulli_distribution stray(0.05);
+    double sink = 0.0;
+    double ns = bench_ns_per_op(count, [&] {
+        for (std::size_t i = 0; i < count; ++i) {
+            sink += store.get(stray(rng) ? any(rng) : working(rng)).swap("X", "Y", 1e-6);
+        }
+    });
+    std::cout << "tiering fleet=" << fleet << " hot=" << store.hot_count() << " bytes=" << store.memory_bytes()
+              << " per_pool=" << static_cast<double>(store.memory_bytes()) / static_cast<double>(fleet) << "B materializations="
+              << store.materializations() << " swap=" << ns << "ns/op" << std::endl;
+    return sink == 0.0;
+}
+
+// allocations per call for every pool method and engine operation other
+// than plain accessors (get_*, pool(), size()) and add_pool(); fails when a
+// method that must stay allocation-free starts allocating
+static int bench_alloc(std::size_t calls) {
+    std::mt19937_64 rng(80);
+    const std::unordered_map<std::string, double> init = {{"X", 100.0}, {"Y", 200.0}, {"Z", 300.0}};
+    const std::unordered_map<std::string, double> proportional = {{"X", 1.0}, {"Y", 2.0}, {"Z", 3.0}};
+    const std::unordered_map<std::string, double> single = {{"X", 1.0}, {"Y", 0.0}, {"Z", 0.0}};
+    InfinityPool base(bench_tokens());
+    base.initialize(init);
+    base.set_invariant();
+    InfinityPool pool = base;
+    auto reset = [&] { pool = base; };
+    auto none = [] {};
+
+    struct Row {
+        const char* name;
+        AllocStats stats;
+        bool must_be_zero;
+    };
+    std::vector<Row> rows;
+    rows.reserve(48);
+    double sink = 0.0;
+
+    rows.push_back({"initialize", bench_allocations(calls, [&] { pool = InfinityPool(bench_tokens()); }, [&] { pool.initialize(init); }), false});
+    rows.push_back({"set_invariant", bench_allocations(calls, none, [&] { sink += pool.set_invariant(); }), true});
+    rows.push_back({"calculate_spot_price", bench_allocations(calls, none, [&] { sink += pool.calculate_spot_price("X", "Y"); }), true});
+    rows.push_back({"quote_swap", bench_allocations(calls, none, [&] { sink += pool.quote_swap("X", "Y", 1e-6); }), true});
+    const double curve_in[4] = {1e-6, 1e-3, 1.0, 10.0};
+    double curve_out[4];
+    double curve_impact[4];
+    rows.push_back({"quote_swap_curve/4", bench_allocations(calls, none, [&] {
+                         pool.quote_swap_curve("X", "Y", curve_in, 4, curve_out, curve_impact);
+                         sink += curve_out[3];
+                     }),
+                    true});
+    rows.push_back({"swap", bench_allocations(calls, none, [&] { sink += pool.swap("X", "Y", 1e-6); }), true});
+    rows.push_back({"deposit_all", bench_allocations(calls, reset, [&] { sink += pool.deposit_all(proportional); }), false});
+    rows.push_back({"deposit_one", bench_allocations(calls, reset, [&] { sink += pool.deposit_one(single); }), false});
+    rows.push_back({"deposit_any", bench_allocations(calls, reset, [&] { sink += pool.deposit_any(proportional); }), false});
+    rows.push_back({"withdraw_all", bench_allocations(calls, reset, [&] { sink += pool.withdraw_all(1.0).size(); }), false});
+    rows.push_back({"withdraw_one", bench_allocations(calls, reset, [&] { sink += pool.withdraw_one("X", 1.0); }), false});
+    rows.push_back({"withdraw_any", bench_allocations(calls, reset, [&] { sink += pool.withdraw_any(1.0, proportional).size(); }), false});
+    rows.push_back({"equalize", bench_allocations(calls, reset, [&] { sink += pool.equalize(proportional, proportional).size(); }), false});
+    rows.push_back({"swap_sensitivity", bench_allocations(calls, none, [&] { sink += pool.swap_sensitivity("X", "Y", 1e-6).d_amount_in; }), true});
+    rows.push_back({"spot_price_sensitivity", bench_allocations(calls, none, [&] { sink += pool.spot_price_sensitivity("X", "Y").price; }), true});
+    rows.push_back({"withdraw_one_sensitivity", bench_allocations(calls, none, [&] { sink += pool.withdraw_one_sensitivity("X", 1.0).amount_out; }), true});
+    rows.push_back({"withdraw_all_sensitivity", bench_allocations(calls, none, [&] { sink += pool.withdraw_all_sensitivity(1.0).size(); }), false});
+    rows.push_back({"status", bench_allocations(calls, none, [&] { sink += pool.status().invariant; }), false});
+    rows.push_back({"memory_footprint", bench_allocations(calls, none, [&] { sink += pool.memory_footprint().total(); }), true});
+    rows.push_back({"shrink_to_fit", bench_allocations(calls, reset, [&] { pool.shrink_to_fit(); }), false});
+    rows.push_back({"to_bytes", bench_allocations(calls, none, [&] { sink += pool.to_bytes().size(); }), false});
+    const std::string bytes = base.to_bytes();
+    rows.push_back({"from_bytes", bench_allocations(calls, none, [&] { sink += InfinityPool::from_bytes(bytes).get_invariant(); }), false});
+    const std::vector<std::unordered_map<std::string, double>> deposit_requests(4, proportional);
+    const std::vector<WithdrawRequest> withdraw_requests = {{"X", 1.0}, {"", 1.0}, {"Y", 1.0}, {"", 1.0}};
+    rows.push_back({"deposit_batch/4", bench_allocations(calls, reset, [&] { sink += pool.deposit_batch(deposit_requests).size(); }), false});
+    rows.push_back({"withdraw_batch/4", bench_allocations(calls, reset, [&] { sink += pool.withdraw_batch(withdraw_requests).size(); }), false});
+    rows.push_back({"StripedPool(pool)", bench_allocations(calls, none, [&] { sink += StripedPool(pool).get_invariant(); }), false});
+
+    const std::size_t fleet = 64;
+    const std::size_t batch = 256;
+    PoolEngine engine;
+    bench_fill_engine(engine, fleet, rng);
+    std::vector<SwapOp> ops = bench_swap_ops(fleet, batch, rng);
+    std::vector<DepositOp> deposits(batch, DepositOp{0, proportional});
+    rows.push_back({"engine.execute_swaps/batch", bench_allocations(calls, none, [&] { sink += engine.execute_swaps(ops).size(); }), false});
+    rows.push_back({"engine.execute_swaps_prefetched/batch", bench_allocations(calls, none, [&] { sink += engine.execute_swaps_prefetched(ops).size(); }), false});
+    rows.push_back({"engine.validate_swaps/batch", bench_allocations(calls, none, [&] { sink += engine.validate_swaps(ops).size(); }), false});
+    rows.push_back({"engine.execute_validated_swaps/batch", bench_allocations(calls, none, [&] { sink += engine.execute_validated_swaps(ops).size(); }), false});
+    rows.push_back({"engine.validate_deposits/batch", bench_allocations(calls, none, [&] { sink += engine.validate_deposits(deposits).size(); }), false});
+    rows.push_back({"engine.execute_validated_deposits/batch",
+                    bench_allocations(calls, none, [&] { sink += engine.execute_validated_deposits(deposits).size(); }), false});
+    rows.push_back({"engine.execute_block/batch", bench_allocations(calls, none, [&] { sink += engine.execute_block(ops).size(); }), false});
+    rows.push_back({"engine.memory_footprint", bench_allocations(calls, none, [&] { sink += engine.memory_footprint().total(); }), true});
+    rows.push_back({"engine.compact", bench_allocations(calls, none, [&] { sink += engine.compact(); }), false});
+
+    int failures = 0;
+    for (const auto& row : rows) {
+        bool failed = row.must_be_zero && row.stats.allocs_per_call != 0.0;
+        failures += failed;
+        std::cout << "alloc " << row.name << " allocs/call=" << row.stats.allocs_per_call << " bytes/call=" << row.stats.bytes_per_call
+                  << (failed ? " FAIL: must not allocate" : "") << std::endl;
+    }
+    return failures != 0 || sink == 0.0;
+}
+
+// runs call(i) for i in [0, calls) under the counters and prints per-op figures
+template <typename Call>
+static void bench_counters(PerfCounters& counters, const char* name, std::size_t calls, Call&& call) {
+    auto start = std::chrono::steady_clock::now();
+    counters.start();
+    for (std::size_t i = 0; i < calls; ++i) {
+        call(i);
+    }
+    counters.stop();
+    auto stop = std::chrono::steady_clock::now();
+
+    std::cout << "perf " << name << " ns=" << std::chrono::duration<double, std::nano>(stop - start).count() / static_cast<double>(calls);
+    std::vector<long long> values = counters.read();
+    for (std::size_t e = 0; e < values.size(); ++e) {
+        std::cout << " " << counters.names()[e] << "=";
+        if (values[e] < 0) {
+            std::cout << "n/a";
+        } else {
+            std::cout << static_cast<double>(values[e]) / static_cast<double>(calls);
+        }
+    }
+    std::cout << std::endl;
+}
+
+// per-op hardware counters for pool methods, next to the building blocks
+// they are made of (pow, map lookups, allocation) for attribution
+static int bench_perf(std::size_t calls) {
+    const std::unordered_map<std::string, double> init = {{"X", 100.0}, {"Y", 200.0}, {"Z", 300.0}};
+    const std::unordered_map<std::string, double> proportional = {{"X", 1.0}, {"Y", 2.0}, {"Z", 3.0}};
+    InfinityPool base(bench_tokens());
+    base.initialize(init);
+    base.set_invariant();
+
+    // mutating methods each get a fresh pool, prepared outside the counted window
+    std::vector<InfinityPool> pools(calls, base);
+    auto fresh = [&] { std::fill(pools.begin(), pools.end(), base); };
+
+    PerfCounters counters;
+    volatile double sink = 0.0;
+    InfinityPool pool = base;
+    std::unordered_map<std::string, double> lookup = init;
+    const std::string x = "X";
+    const std::string y = "Y";
+
+    bench_counters(counters, "std::pow", calls, [&](std::size_t i) { sink = sink + std::pow(0.999 - 1e-9 * static_cast<double>(i), 0.5); });
+    bench_counters(counters, "unordered_map::find x2", calls, [&](std::size_t) { sink = sink + lookup.find(x)->second + lookup.find(y)->second; });
+    bench_counters(counters, "operator new/delete", calls, [&](std::size_t) {
+        double* volatile p = new double(sink);
+        delete p;
+    });
+    bench_counters(counters, "set_invariant", calls, [&](std::size_t) { sink = sink + pool.set_invariant(); });
+    bench_counters(counters, "calculate_spot_price", calls, [&](std::size_t) { sink = sink + pool.calculate_spot_price(x, y); });
+    bench_counters(counters, "swap", calls, [&](std::size_t i) { sink = sink + pools[i].swap(x, y, 1e-3); });
+    fresh();
+    bench_counters(counters, "deposit_all", calls, [&](std::size_t i) { sink = sink + pools[i].deposit_all(proportional); });
+    fresh();
+    bench_counters(counters, "withdraw_one", calls, [&](std::size_t i) { sink = sink + pools[i].withdraw_one(x, 1.0); });
+    fresh();
+    bench_counters(counters, "withdraw_all", calls, [&](std::size_t i) { sink = sink + pools[i].withdraw_all(1.0).size(); });
+    fresh();
+    bench_counters(counters, "equalize", calls, [&](std::size_t i) { sink = sink + pools[i].equalize(proportional, proportional).size(); });
+    return 0;
+}
+
+// runs a generated stream op by op and reports cost and rejections per kind
+static int bench_workload(std::size_t fleet, std::size_t count, double read_ratio, double zipf) {
+    std::mt19937_64 rng(82);
+    PoolEngine engine;
+    bench_fill_engine(engine, fleet, rng);
+    WorkloadConfig config;
+    config.seed = 82;
+    config.read_ratio = read_ratio;
+    config.zipf_exponent = zipf;
+    WorkloadGenerator generator(engine, config);
+
+    const std::size_t kinds = static_cast<std::size_t>(OpKind::EQUALIZE) + 1;
+    std::vector<std::size_t> executed(kinds);
+    std::vector<std::size_t> rejected(kinds);
+    std::vector<double> nanos(kinds);
+    double sink = 0.0;
+    for (std::size_t i = 0; i < count; ++i) {
+        WorkloadOp op = generator.next();
+        std::size_t k = static_cast<std::size_t>(op.kind);
+        auto start = std::chrono::steady_clock::now();
+        try {
+            sink += apply_workload_op(engine, op);
+            ++executed[k];
+        } catch (const std::exception&) {
+            ++rejected[k];
+        }
+        nanos[k] += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+    for (std::size_t k = 0; k < kinds; ++k) {
+        std::size_t n = executed[k] + rejected[k];
+        std::cout << "workload " << op_kind_name(static_cast<OpKind>(k)) << " ops=" << n << " rejected=" << rejected[k]
+                  << " ns/op=" << (n ? nanos[k] / static_cast<double>(n) : 0.0) << std::endl;
+    }
+    return sink == 0.0;
+}
+
+// Open-loop load against a PoolServer: each client sends on a fixed schedule
+// whether or not earlier requests have completed, and latency is measured
+// from the scheduled send time, so server stalls are not hidden by clients
+// that fell behind (no coordinated omission).
+static int bench_load(std::size_t fleet, std::size_t workers, std::size_t clients, double seconds, double max_rate) {
+    std::mt19937_64 rng(83);
+    PoolEngine engine;
+    bench_fill_engine(engine, fleet, rng);
+    WorkloadConfig config;
+    config.seed = 83;
+    config.read_ratio = 0.8;
+    config.deposit_weight = 0.0;
+    config.withdraw_weight = 0.0;
+    config.equalize_weight = 0.0;
+    WorkloadGenerator generator(engine, config);
+    PoolServer server(engine, workers);
+
+    using clock = std::chrono::steady_clock;
+    std::cout << "load fleet=" << fleet << " workers=" << workers << " clients=" << clients << std::endl;
+    for (double rate = 10000.0; rate <= max_rate; rate *= 2.0) {
+        const std::size_t total = static_cast<std::size_t>(rate * seconds);
+        std::vector<WorkloadOp> ops = generator.generate(total);
+        std::vector<double> latency(total);
+        std::vector<clock::time_point> finished(total);
+        std::atomic<std::size_t> remaining(total);
+        std::atomic<std::size_t> failures(0);
+
+        const clock::time_point start = clock::now() + std::chrono::milliseconds(10);
+        auto intended = [&](std::size_t k) {
+            return start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(static_cast<double>(k) / rate));
+        };
+        std::vector<std::thread> senders;
+        for (std::size_t c = 0; c < clients; ++c) {
+            senders.emplace_back([&, c] {
+                for (std::size_t k = c; k < total; k += clients) {
+                    clock::time_point due = intended(k);
+                    std::this_thread::sleep_until(due);
+                    server.submit(ops[k], [&, k, due](double, bool ok) {
+                        clock::time_point now = clock::now();
+                        latency[k] = std::chrono::duration<double, std::micro>(now - due).count();
+                        finished[k] = now;
+                        failures.fetch_add(!ok, std::memory_order_relaxed);
+                        remaining.fetch_sub(1, std::memory_order_release);
+                    });
+                }
+            });
+        }
+        for (auto& sender : senders) {
+            sender.join();
+        }
+        while (remaining.load(std::memory_order_acquire) != 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+
+        clock::time_point last = *std::max_element(finished.begin(), finished.end());
+        double elapsed = std::chrono::duration<double>(last - start).count();
+        std::sort(latency.begin(), latency.end());
+        auto percentile = [&](double q) { return latency[std::min(total - 1, static_cast<std::size_t>(q * static_cast<double>(total)))]; };
+        double throughput = static_cast<double>(total) / elapsed;
+        std::cout << "load offered=" << rate << "/s achieved=" << throughput << "/s p50=" << percentile(0.5) << "us p99=" << percentile(0.99)
+                  << "us p999=" << percentile(0.999) << "us max=" << latency.back() << "us failed=" << failures.load() << std::endl;
+        if (throughput < 0.9 * rate) {
+            std::cout << "load saturated near " << throughput << "/s" << std::endl;
+            break;
+        }
+    }
+    return 0;
+}
+
+// WORST-CASE SEARCH
+// Cost-guided mutation of small pools and op sequences, keeping whatever
+// maximizes CPU time per op: huge token counts, subnormal balances, skewed
+// weights and token names that all land in one hash bucket.
+
+struct StressOp {
+    OpKind kind;
+    std::size_t a;
+    std::size_t b;
+    double fraction;  // of the balance of token a
+};
+
+struct StressCase {
+    std::size_t token_count;
+    bool colliding_names;
+    int balance_exponent;  // balances are around 10^balance_exponent
+    double skew;           // ratio between the largest and smallest balance
+    std::vector<StressOp> ops;
+};
+
+// names whose hashes share one bucket of a map holding `count` of them
+static const std::vector<std::string>& stress_names(std::size_t count, bool colliding) {
+    static std::map<std::pair<std::size_t, bool>, std::vector<std::string>> cache;
+    std::vector<std::string>& names = cache[{count, colliding}];
+    if (!names.empty()) {
+        return names;
+    }
+    std::unordered_map<std::string, double> probe;
+    for (std::size_t i = 0; i < count; ++i) {
+        probe["p" + std::to_string(i)] = 0.0;
+    }
+    const std::size_t buckets = probe.bucket_count();
+    std::hash<std::string> hash;
+    for (std::size_t i = 0; names.size() < count; ++i) {
+        std::string name = "T" + std::to_string(i);
+        if (!colliding || hash(name) % buckets == 0) {
+            names.push_back(name);
+        }
+    }
+    return names;
+}
+
+static InfinityPool stress_pool(const StressCase& c) {
+    const std::vector<std::string>& names = stress_names(c.token_count, c.colliding_names);
+    InfinityPool pool(names);
+    std::unordered_map<std::string, double> amount_in;
+    for (std::size_t t = 0; t < names.size(); ++t) {
+        double spread = std::pow(c.skew, static_cast<double>(t) / static_cast<double>(names.size() - 1));
+        amount_in[names[t]] = std::pow(10.0, c.balance_exponent) * spread;
+    }
+    pool.initialize(amount_in);
+    pool.set_invariant();
+    return pool;
+}
+
+static void stress_run(InfinityPool& pool, const StressCase& c, double& sink) {
+    const std::vector<std::string>& names = pool.get_tokens();
+    std::unordered_map<std::string, double> amounts;
+    for (const auto& op : c.ops) {
+        const std::string& a = names[op.a % names.size()];
+        const std::string& b = names[op.b % names.size()];
+        try {
+            switch (op.kind) {
+                case OpKind::QUOTE:
+                    sink += pool.calculate_spot_price(a, b);
+                    break;
+                case OpKind::SWAP:
+                    sink += pool.swap(a, b, op.fraction * pool.get_balance(a));
+                    break;
+                case OpKind::WITHDRAW_ONE:
+                    sink += pool.withdraw_one(a, op.fraction * SUPPLY);
+                    break;
+                default:
+                    amounts.clear();
+                    for (const auto& name : names) {
+                        amounts[name] = op.fraction * pool.get_balance(name);
+                    }
+                    sink += op.kind == OpKind::EQUALIZE ? pool.equalize(amounts, amounts).size() : pool.deposit_all(amounts);
+                    break;
+            }
+        } catch (const std::exception&) {
+            sink += 1.0;
+        }
+    }
+}
+
+// best of three runs on fresh copies, in ns per op
+static double stress_cost(const StressCase& c, double& sink) {
+    InfinityPool base = stress_pool(c);
+    double best = std::numeric_limits<double>::infinity();
+    for (int rep = 0; rep < 3; ++rep) {
+        InfinityPool pool = base;
+        best = std::min(best, bench_ns_per_op(c.ops.size(), [&] { stress_run(pool, c, sink); }));
+    }
+    return best;
+}
+
+static StressOp stress_random_op(std::mt19937_64& rng) {
+    const OpKind kinds[] = {OpKind::QUOTE, OpKind::SWAP, OpKind::DEPOSIT_ALL, OpKind::WITHDRAW_ONE, OpKind::EQUALIZE};
+    return {kinds[rng() % 5], static_cast<std::size_t>(rng() % 4096), static_cast<std::size_t>(rng() % 4096),
+            std::pow(10.0, -static_cast<double>(rng() % 12))};
+}
+
+static StressCase stress_mutate(StressCase c, std::size_t max_tokens, std::mt19937_64& rng) {
+    switch (rng() % 6) {
+        case 0:
+            c.token_count = std::min(max_tokens, (rng() & 1) ? c.token_count * 2 : c.token_count + 1 + rng() % 8);
+            break;
+        case 1:
+            c.colliding_names = !c.colliding_names;
+            break;
+        case 2:
+            c.balance_exponent = std::max(-320, std::min(300, c.balance_exponent + static_cast<int>(rng() % 101) - 50));
+            break;
+        case 3:
+            c.skew = std::max(1.0, std::min(1e300, c.skew * std::pow(10.0, static_cast<double>(rng() % 41) - 20.0)));
+            break;
+        case 4:
+            c.ops[rng() % c.ops.size()] = stress_random_op(rng);
+            break;
+        default:
+            if (c.ops.size() < 64) {
+                c.ops.push_back(stress_random_op(rng));
+            }
+            break;
+    }
+    return c;
+}
+
+static std::string stress_describe(const StressCase& c) {
+    std::map<std::string, int> mix;
+    for (const auto& op : c.ops) {
+        ++mix[op_kind_name(op.kind)];
+    }
+    std::ostringstream out;
+    out << "tokens=" << c.token_count << (c.colliding_names ? " colliding" : "") << " balance=1e" << c.balance_exponent << " skew=" << c.skew
+        << " ops=";
+    for (const auto& entry : mix) {
+        out << entry.first << ":" << entry.second << " ";
+    }
+    return out.str();
+}
+
+// (mu + lambda) search: each generation mutates the survivors and keeps the
+// most expensive cases; token count is capped, since cost trivially grows with it
+static int bench_search(std::size_t generations, std::size_t population, std::size_t max_tokens, std::uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    double sink = 0.0;
+    StressCase baseline{3, false, 2, 3.0, {}};
+    for (int i = 0; i < 8; ++i) {
+        baseline.ops.push_back(stress_random_op(rng));
+    }
+    double baseline_cost = stress_cost(baseline, sink);
+    std::cout << "search baseline " << baseline_cost << "ns/op " << stress_describe(baseline) << std::endl;
+
+    std::vector<std::pair<double, StressCase>> survivors = {{baseline_cost, baseline}};
+    for (std::size_t g = 0; g < generations; ++g) {
+        std::vector<std::pair<double, StressCase>> next = survivors;
+        for (std::size_t i = 0; i < population; ++i) {
+            StressCase child = stress_mutate(survivors[rng() % survivors.size()].second, max_tokens, rng);
+            next.push_back({stress_cost(child, sink), child});
+        }
+        std::sort(next.begin(), next.end(), [](const auto& x, const auto& y) { return x.first > y.first; });
+        next.resize(std::min(next.size(), population / 2 + 1));
+        // costs are noisy; re-measure survivors so a lucky outlier cannot stay on top
+        for (auto& entry : next) {
+            entry.first = std::min(entry.first, stress_cost(entry.second, sink));
+        }
+        survivors.swap(next);
+        if (g % 10 == 0 || g + 1 == generations) {
+            std::cout << "search gen=" << g << " worst " << survivors.front().first << "ns/op (" << survivors.front().first / baseline_cost
+                      << "x baseline) " << stress_describe(survivors.front().second) << std::endl;
+        }
+    }
+    return sink == 0.0;
+}
+
+// builds a journal of LP entries and exits interleaved with swaps, then
+// analyzes every LP in one pass
+static int bench_lp(std::size_t lps, std::size_t trades) {
+    std::mt19937_64 rng(85);
+    InfinityPool pool(bench_tokens());
+    pool.initialize({{"X", 1000.0}, {"Y", 2000.0}, {"Z", 3000.0}});
+    pool.set_invariant();
+
+    // self-check: one deposit and no trades must show no PnL and no loss
+    {
+        InfinityPool quiet = pool;
+        PoolJournal history(quiet);
+        std::unordered_map<std::string, double> amount_in;
+        for (const auto& t : bench_tokens()) {
+            amount_in[t] = 0.01 * quiet.get_balance(t);
+        }
+        double shares = quiet.deposit_batch({amount_in})[0];
+        history.record_deposit(quiet, 0, shares, amount_in);
+        LpReport r = analyze_lps(history, 1)[0];
+        if (std::abs(r.pnl_vs_hold) > 1e-9 * r.position_value || std::abs(r.impermanent_loss) > 1e-9 * r.position_value) {
+            std::cerr << "lp self-check failed: pnl=" << r.pnl_vs_hold << " il=" << r.impermanent_loss << std::endl;
+            return 1;
+        }
+    }
+
+    PoolJournal journal(pool);
+
+    std::uniform_int_distribution<std::size_t> lp(0, lps - 1);
+    std::uniform_real_distribution<double> size(1e-5, 1e-3);
+    std::uniform_int_distribution<int> token(0, 2);
+    const std::vector<std::string> tokens = bench_tokens();
+    for (std::size_t i = 0; i < lps + trades; ++i) {
+        if (i < lps || i % 64 == 0) {
+            std::unordered_map<std::string, double> amount_in;
+            double fraction = size(rng);
+            for (const auto& t : tokens) {
+                amount_in[t] = fraction * pool.get_balance(t);
+            }
+            try {
+                double shares = pool.deposit_all(amount_in);
+                journal.record_deposit(pool, i < lps ? i : lp(rng), shares, amount_in);
+            } catch (const std::invalid_argument&) {
+            }
+        } else {
+            int t_in = token(rng);
+            int t_out = (t_in + 1 + token(rng) % 2) % 3;
+            pool.swap(tokens[t_in], tokens[t_out], size(rng) * pool.get_balance(tokens[t_in]));
+            journal.record_trade(pool);
+        }
+    }
+
+    std::vector<LpReport> reports;
+    double ns = bench_ns_per_op(journal.entries().size(), [&] { reports = analyze_lps(journal, lps); });
+    LpReport sum{0.0, 0.0, 0.0, 0.0, 0.0};
+    for (const auto& r : reports) {
+        sum.position_value += r.position_value;
+        sum.hold_value += r.hold_value;
+        sum.pnl_vs_hold += r.pnl_vs_hold;
+        sum.invariant_drift += r.invariant_drift;
+        sum.impermanent_loss += r.impermanent_loss;
+    }
+    std::cout << "lp lps=" << lps << " entries=" << journal.entries().size() << " ns/entry=" << ns << " position=" << sum.position_value
+              << " hold=" << sum.hold_value << " pnl=" << sum.pnl_vs_hold << " drift=" << sum.invariant_drift << " il=" << sum.impermanent_loss
+              << std::endl;
+    return 0;
+}
+
+// VaR/CVaR of an LP position in every pool of a random fleet over a shared token universe
+static int bench_risk(std::size_t fleet, std::size_t universe, std::size_t scenarios, std::size_t threads) {
+    std::mt19937_64 rng(86);
+    std::vector<std::string> tokens;
+    std::vector<double> prices;
+    std::vector<double> volatility;
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (std::size_t u = 0; u < universe; ++u) {
+        tokens.push_back("T" + std::to_string(u));
+        prices.push_back(1.0 + 99.0 * unit(rng));
+        volatility.push_back(0.2 + 0.8 * unit(rng));
+    }
+    // one-factor correlation
+    std::vector<double> correlation(universe * universe);
+    for (std::size_t i = 0; i < universe; ++i) {
+        for (std::size_t j = 0; j < universe; ++j) {
+            correlation[i * universe + j] = i == j ? 1.0 : 0.5;
+        }
+    }
+
+    PoolEngine engine;
+    std::vector<LpPosition> positions;
+    std::uniform_int_distribution<std::size_t> width(2, 8);
+    for (std::size_t i = 0; i < fleet; ++i) {
+        std::vector<std::string> names;
+        std::size_t n = std::min(width(rng), universe);
+        std::vector<std::size_t> pick(universe);
+        std::iota(pick.begin(), pick.end(), 0);
+        std::shuffle(pick.begin(), pick.end(), rng);
+        std::unordered_map<std::string, double> amount_in;
+        for (std::size_t t = 0; t < n; ++t) {
+            names.push_back(tokens[pick[t]]);
+            amount_in[tokens[pick[t]]] = 1.0 + 999.0 * unit(rng);
+        }
+        std::size_t id = engine.add_pool(names);
+        engine.pool(id).initialize(amount_in);
+        positions.push_back({id, 0.01});
+    }
+
+    RiskEngine risk(engine, positions, tokens, prices, volatility, correlation);
+    RiskConfig config;
+    config.scenarios = scenarios;
+    config.threads = threads;
+    RiskReport report;
+    double ns = bench_ns_per_op(scenarios, [&] { report = risk.run(config); });
+    std::cout << "risk pools=" << fleet << " tokens=" << universe << " scenarios=" << scenarios << " value=" << report.value << " var99=" << report.var
+              << " cvar99=" << report.cvar << " ns/scenario=" << ns << std::endl;
+    return 0;
+}
+
+// moves a concentrated portfolio to equal weights through overlapping pools
+static int bench_rebalance(std::size_t tokens, std::size_t pools_per_pair) {
+    std::mt19937_64 rng(87);
+    std::uniform_real_distribution<double> balance(1000.0, 10000.0);
+    std::vector<std::string> names;
+    for (std::size_t t = 0; t < tokens; ++t) {
+        names.push_back("T" + std::to_string(t));
+    }
+    PoolEngine engine;
+    for (std::size_t a = 0; a < tokens; ++a) {
+        for (std::size_t b = a + 1; b < tokens; ++b) {
+            for (std::size_t k = 0; k < pools_per_pair; ++k) {
+                std::size_t id = engine.add_pool({names[a], names[b]});
+                engine.pool(id).initialize({{names[a], balance(rng)}, {names[b], balance(rng)}});
+                engine.pool(id).set_invariant();
+            }
+        }
+    }
+
+    std::unordered_map<std::string, double> holdings = {{names[0], 500.0}};
+    std::unordered_map<std::string, double> target;
+    for (const auto& name : names) {
+        target[name] = 1.0;
+    }
+    PairwiseRebalancer rebalancer(engine);
+    RebalancePlan plan;
+    double ns = bench_ns_per_op(1, [&] { plan = rebalancer.plan(holdings, target, names[0]); });
+    std::unordered_map<std::string, double> after = rebalancer.execute(plan, holdings);
+
+    double before_value = 0.0;
+    double after_value = 0.0;
+    for (const auto& entry : holdings) {
+        before_value += entry.second * plan.prices.at(entry.first);
+    }
+    for (const auto& entry : after) {
+        after_value += entry.second * plan.prices.at(entry.first);
+    }
+    std::cout << "rebalance tokens=" << tokens << " pools=" << engine.size() << " swaps=" << plan.swaps.size() << " plan=" << ns / 1000.0
+              << "us slippage=" << 1.0 - after_value / before_value << std::endl;
+    return 0;
+}
+
+// sweeps the weight simplex for a new pool against a year of simulated daily prices
+static int bench_sweep(std::size_t tokens, double step, std::size_t paths) {
+    std::vector<PricePath> history = simulate_price_paths(tokens, paths, 365, 0.8, 1.0 / 365.0, 88);
+    WeightSweepConfig config;
+    config.step = step;
+    std::vector<WeightCandidate> ranked;
+    double ns = bench_ns_per_op(1, [&] { ranked = sweep_weights(tokens, history, config); });
+    std::size_t pruned = std::count_if(ranked.begin(), ranked.end(), [](const WeightCandidate& c) { return c.pruned; });
+    std::size_t evaluations = 0;
+    for (const auto& c : ranked) {
+        evaluations += c.paths;
+    }
+    std::cout << "sweep candidates=" << ranked.size() << " pruned=" << pruned << " evaluations=" << evaluations << " of "
+              << ranked.size() * paths << " time=" << ns / 1e6 << "ms" << std::endl;
+    for (std::size_t i = 0; i < std::min<std::size_t>(5, ranked.size()); ++i) {
+        std::cout << "sweep #" << i + 1 << " weights=";
+        for (double w : ranked[i].weights) {
+            std::cout << w << " ";
+        }
+        std::cout << "score=" << ranked[i].mean << " +/- " << ranked[i].std_error << std::endl;
+    }
+    return 0;
+}
+
+// impact curve for one pair: quote_swap per size vs one quote_swap_curve call
+static int bench_impact(std::size_t sizes, std::size_t rounds) {
+    InfinityPool pool(bench_tokens());
+    pool.initialize({{"X", 100.0}, {"Y", 200.0}, {"Z", 300.0}});
+    std::vector<double> amount_in(sizes);
+    for (std::size_t i = 0; i < sizes; ++i) {
+        amount_in[i] = 100.0 * static_cast<double>(i + 1) / static_cast<double>(sizes + 1);
+    }
+    std::vector<double> amount_out(sizes);
+    std::vector<double> impact(sizes);
+    const std::string x = "X";
+    const std::string y = "Y";
+
+    double scalar = bench_ns_per_op(sizes * rounds, [&] {
+        for (std::size_t r = 0; r < rounds; ++r) {
+            for (std::size_t i = 0; i < sizes; ++i) {
+                amount_out[i] = pool.quote_swap(x, y, amount_in[i]);
+            }
+        }
+    });
+    double sink = amount_out.back();
+    double curve = bench_ns_per_op(sizes * rounds, [&] {
+        for (std::size_t r = 0; r < rounds; ++r) {
+            pool.quote_swap_curve(x, y, amount_in.data(), sizes, amount_out.data(), impact.data());
+        }
+    });
+    std::cout << "impact sizes=" << sizes << " quote_swap=" << scalar << "ns/size curve=" << curve << "ns/size max_impact=" << impact.back()
+              << std::endl;
+    return sink == amount_out.back() ? 0 : 1;
+}
+
+// multi-hop routes over `fleet` wide pools: per-hop swap() vs one flash
+// transaction per route; smaller fleets mean more hops revisit a pool
+static int bench_flash(std::size_t tokens, std::size_t hops, std::size_t fleet, std::size_t routes) {
+    std::vector<std::string> names;
+    for (std::size_t t = 0; t < tokens; ++t) {
+        names.push_back("T" + std::to_string(t));
+    }
+    PoolEngine direct;
+    PoolEngine flash;
+    std::mt19937_64 rng(91);
+    std::uniform_real_distribution<double> balance(1000.0, 10000.0);
+    for (std::size_t i = 0; i < fleet; ++i) {
+        std::unordered_map<std::string, double> amount_in;
+        for (const auto& name : names) {
+            amount_in[name] = balance(rng);
+        }
+        for (PoolEngine* engine : {&direct, &flash}) {
+            std::size_t id = engine->add_pool(names);
+            engine->pool(id).initialize(amount_in);
+            engine->pool(id).set_invariant();
+        }
+    }
+
+    std::uniform_int_distribution<std::size_t> pick(0, fleet - 1);
+    std::vector<std::size_t> route_pools(routes * hops);
+    for (auto& id : route_pools) {
+        id = pick(rng);
+    }
+
+    double direct_ns = bench_ns_per_op(routes, [&] {
+        for (std::size_t r = 0; r < routes; ++r) {
+            double amount = 1e-3;
+            for (std::size_t h = 0; h < hops; ++h) {
+                amount = direct.pool(route_pools[r * hops + h]).swap(names[h % tokens], names[(h + 1) % tokens], amount);
+            }
+        }
+    });
+    FlashTransaction tx(flash);
+    double flash_ns = bench_ns_per_op(routes, [&] {
+        for (std::size_t r = 0; r < routes; ++r) {
+            double amount = 1e-3;
+            for (std::size_t h = 0; h < hops; ++h) {
+                amount = tx.swap(route_pools[r * hops + h], names[h % tokens], names[(h + 1) % tokens], amount);
+            }
+            tx.commit();
+        }
+    });
+
+    double max_diff = 0.0;
+    for (std::size_t id = 0; id < fleet; ++id) {
+        for (const auto& name : names) {
+            double a = direct.pool(id).get_balance(name);
+            max_diff = std::max(max_diff, std::abs(a - flash.pool(id).get_balance(name)) / a);
+            max_diff = std::max(max_diff, std::abs(direct.pool(id).get_invariant() / flash.pool(id).get_invariant() - 1.0));
+        }
+    }
+    std::cout << "flash tokens=" << tokens << " hops=" << hops << " direct=" << direct_ns << "ns/route flash=" << flash_ns
+              << "ns/route max_rel_diff=" << max_diff << std::endl;
+    return max_diff < 1e-9 ? 0 : 1;
+}
+
+// epoch-boundary LP deposits into one pool, a tenth of them off-ratio:
+// validated one at a time vs one deposit_batch()
+static int bench_lp_deposit(std::size_t tokens, std::size_t deposits) {
+    std::vector<std::string> names;
+    for (std::size_t t = 0; t < tokens; ++t) {
+        names.push_back("T" + std::to_string(t));
+    }
+    std::mt19937_64 rng(92);
+    std::uniform_real_distribution<double> balance(1000.0, 10000.0);
+    std::unordered_map<std::string, double> initial;
+    for (const auto& name : names) {
+        initial[name] = balance(rng);
+    }
+
+    std::uniform_real_distribution<double> scale(1e-4, 1e-2);
+    std::vector<DepositOp> ops;
+    std::vector<std::unordered_map<std::string, double>> amount_in;
+    for (std::size_t i = 0; i < deposits; ++i) {
+        double s = scale(rng);
+        std::unordered_map<std::string, double> deposit;
+        for (const auto& name : names) {
+            deposit[name] = initial.at(name) * s;
+        }
+        if (i % 10 == 9) {
+            deposit[names[0]] *= 2.0;
+        }
+        ops.push_back({0, deposit});
+        amount_in.push_back(deposit);
+    }
+
+    PoolEngine engine;
+    engine.add_pool(names);
+    engine.pool(0).initialize(initial);
+    engine.pool(0).set_invariant();
+    InfinityPool batched = engine.pool(0);
+
+    std::vector<double> single_shares;
+    std::vector<double> batch_shares;
+    double single = bench_ns_per_op(deposits, [&] { single_shares = engine.execute_validated_deposits(ops); });
+    double batch = bench_ns_per_op(deposits, [&] { batch_shares = batched.deposit_batch(amount_in); });
+
+    std::size_t mismatched = 0;
+    double single_total = 0.0;
+    double batch_total = 0.0;
+    for (std::size_t i = 0; i < deposits; ++i) {
+        mismatched += std::isnan(single_shares[i]) != std::isnan(batch_shares[i]);
+        single_total += std::isnan(single_shares[i]) ? 0.0 : single_shares[i];
+        batch_total += std::isnan(batch_shares[i]) ? 0.0 : batch_shares[i];
+    }
+    double max_diff = std::abs(engine.pool(0).get_invariant() / batched.get_invariant() - 1.0);
+    for (const auto& name : names) {
+        max_diff = std::max(max_diff, std::abs(engine.pool(0).get_balance(name) / batched.get_balance(name) - 1.0));
+    }
+    std::cout << "lpdeposit tokens=" << tokens << " deposits=" << deposits << " single=" << single << "ns/deposit batch=" << batch
+              << "ns/deposit accept_mismatches=" << mismatched << " max_rel_diff=" << max_diff << " shares single=" << single_total
+              << " batch=" << batch_total << std::endl;
+    return mismatched == 0 && max_diff < 1e-9 ? 0 : 1;
+}
+
+// epoch-boundary LP exits from one pool, half withdraw_all and half
+// withdraw_one: one call per request vs withdraw_batch() in two orders
+static int bench_lp_withdraw(std::size_t tokens, std::size_t requests) {
+    std::vector<std::string> names;
+    for (std::size_t t = 0; t < tokens; ++t) {
+        names.push_back("T" + std::to_string(t));
+    }
+    std::mt19937_64 rng(93);
+    std::uniform_real_distribution<double> balance(1000.0, 10000.0);
+    std::unordered_map<std::string, double> initial;
+    for (const auto& name : names) {
+        initial[name] = balance(rng);
+    }
+    InfinityPool pool(names);
+    pool.initialize(initial);
+    pool.set_invariant();
+
+    // redemptions small enough that the whole batch stays within the shares issued
+    std::uniform_real_distribution<double> redeem(1.0, 2.0 * FIRST * SUPPLY / static_cast<double>(requests) * 1e-3);
+    std::uniform_int_distribution<std::size_t> token(0, tokens - 1);
+    std::vector<WithdrawRequest> batch;
+    for (std::size_t i = 0; i < requests; ++i) {
+        batch.push_back({i % 2 ? names[token(rng)] : std::string(), redeem(rng)});
+    }
+    std::vector<WithdrawRequest> reversed(batch.rbegin(), batch.rend());
+
+    InfinityPool single = pool;
+    double single_ns = bench_ns_per_op(requests, [&] {
+        for (const auto& request : batch) {
+            if (request.token.empty()) {
+                single.withdraw_all(request.redeem);
+            } else {
+                single.withdraw_one(request.token, request.redeem);
+            }
+        }
+    });
+
+    InfinityPool forward_pool = pool;
+    InfinityPool reversed_pool = pool;
+    std::vector<double> forward_out;
+    std::vector<double> reversed_out;
+    double batch_ns = bench_ns_per_op(requests, [&] { forward_out = forward_pool.withdraw_batch(batch); });
+    reversed_out = reversed_pool.withdraw_batch(reversed);
+
+    // the same request must get the same tokens whichever order the batch was in
+    double drift = 0.0;
+    for (std::size_t i = 0; i < requests; ++i) {
+        for (std::size_t t = 0; t < tokens; ++t) {
+            double a = forward_out[i * tokens + t];
+            double b = reversed_out[(requests - 1 - i) * tokens + t];
+            drift = std::max(drift, a == b ? 0.0 : std::abs(a - b) / std::max(std::abs(a), std::abs(b)));
+        }
+    }
+    std::cout << "lpwithdraw tokens=" << tokens << " requests=" << requests << " single=" << single_ns << "ns/request batch=" << batch_ns
+              << "ns/request order_drift=" << drift << std::endl;
+    return drift < 1e-12 ? 0 : 1;
+}
+
+// quote_swap() on equal, 80/20, 2/3-1/3 and irregular two-token pools, with
+// the largest deviation of each kernel from the generic pow() curve
+static int bench_kernels(std::size_t quotes) {
+    const std::vector<std::pair<const char*, std::pair<double, double>>> shapes = {
+        {"equal", {100.0, 100.0}}, {"80/20", {400.0, 100.0}}, {"2/3-1/3", {200.0, 100.0}}, {"irregular", {123.4, 567.8}}};
+    // sizes log-uniform over 1e-12 .. 0.5 of the smaller balance, so the
+    // small end, where 1 - r^e cancels if taken literally, is covered
+    std::uniform_real_distribution<double> log_fraction(std::log(1e-12), std::log(0.5));
+    double worst = 0.0;
+    double sink = 0.0;
+    for (const auto& shape : shapes) {
+        InfinityPool pool({"X", "Y"});
+        pool.initialize({{"X", shape.second.first}, {"Y", shape.second.second}});
+        pool.set_invariant();
+        std::mt19937_64 rng(94);
+        std::vector<double> amount(quotes);
+        for (auto& a : amount) {
+            a = std::exp(log_fraction(rng)) * std::min(shape.second.first, shape.second.second);
+        }
+
+        const std::string x = "X";
+        const std::string y = "Y";
+        double ns = bench_ns_per_op(quotes, [&] {
+            for (std::size_t i = 0; i < quotes; ++i) {
+                sink += i % 2 ? pool.quote_swap(x, y, amount[i]) : pool.quote_swap(y, x, amount[i]);
+            }
+        });
+
+        // against the curve in long double, which every kernel should match
+        // to a few ulps at any size
+        double deviation = 0.0;
+        for (std::size_t i = 0; i < quotes; ++i) {
+            const std::string& t_in = i % 2 ? x : y;
+            const std::string& t_out = i % 2 ? y : x;
+            long double e = static_cast<long double>(pool.get_weight(t_in)) / pool.get_weight(t_out);
+            long double exact = -pool.get_balance(t_out) * std::expm1(e * std::log1p(-static_cast<long double>(amount[i]) / pool.get_balance(t_in)));
+            deviation = std::max(deviation, static_cast<double>(std::abs(pool.quote_swap(t_in, t_out, amount[i]) / exact - 1.0L)));
+        }
+        worst = std::max(worst, deviation);
+        std::cout << "kernels " << shape.first << " quote=" << ns << "ns max_rel_diff=" << deviation << std::endl;
+    }
+    return worst < 1e-13 && sink > 0.0 ? 0 : 1;
+}
+
+// set_invariant() and withdraw_all() across pool sizes, fixed-arity kernels
+// (2, 3, 4, 8, 16) next to generic ones, checked bit for bit against the
+// per-token formulas
+static int bench_size_class(std::size_t calls) {
+    std::mt19937_64 rng(95);
+    std::uniform_real_distribution<double> balance(1000.0, 10000.0);
+    std::size_t mismatches = 0;
+    for (std::size_t n : {2, 3, 4, 5, 8, 12, 16, 17}) {
+        std::vector<std::string> names;
+        std::unordered_map<std::string, double> amount_in;
+        for (std::size_t t = 0; t < n; ++t) {
+            names.push_back("T" + std::to_string(t));
+            amount_in[names.back()] = balance(rng);
+        }
+        InfinityPool pool(names);
+        pool.initialize(amount_in);
+
+        double sink = 0.0;
+        double invariant_ns = bench_ns_per_op(calls, [&] {
+            for (std::size_t i = 0; i < calls; ++i) {
+                sink += pool.set_invariant();
+            }
+        });
+        double expected = 1.0;
+        for (const auto& name : names) {
+            expected *= std::pow(pool.get_balance(name), pool.get_weight(name));
+        }
+        mismatches += pool.set_invariant() != expected;
+
+        const double redeem = 1e-3 * SUPPLY;
+        std::vector<double> expected_out;
+        for (const auto& name : names) {
+            expected_out.push_back(pool.get_balance(name) * (1.0 - std::pow(pool.get_shares_issued() - redeem / SUPPLY, 1.0 / pool.get_weight(name))));
+        }
+        InfinityPool copy = pool;
+        std::unordered_map<std::string, double> out = copy.withdraw_all(redeem);
+        for (std::size_t t = 0; t < n; ++t) {
+            mismatches += out.at(names[t]) != expected_out[t];
+        }
+        double withdraw_ns = bench_ns_per_op(calls, [&] {
+            for (std::size_t i = 0; i < calls; ++i) {
+                InfinityPool trial = pool;
+                sink += trial.withdraw_all(redeem).size();
+            }
+        });
+        std::cout << "sizeclass tokens=" << n << " set_invariant=" << invariant_ns << "ns withdraw_all(with copy)=" << withdraw_ns << "ns"
+                  << (sink > 0.0 ? "" : " no-op") << std::endl;
+    }
+    std::cout << "sizeclass mismatches=" << mismatches << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+
+// random swaps on a wide pool from several threads: InfinityPool::swap()
+// behind one mutex vs StripedPool
+static int bench_striped(std::size_t tokens, std::size_t threads, std::size_t swaps) {
+    std::vector<std::string> names;
+    std::unordered_map<std::string, double> amount_in;
+    std::mt19937_64 rng(96);
+    std::uniform_real_distribution<double> balance(1000.0, 10000.0);
+    for (std::size_t t = 0; t < tokens; ++t) {
+        names.push_back("T" + std::to_string(t));
+        amount_in[names.back()] = balance(rng);
+    }
+    InfinityPool pool(names);
+    pool.initialize(amount_in);
+    pool.set_invariant();
+
+    // per-thread op streams, generated up front
+    std::vector<std::vector<std::pair<std::size_t, std::size_t>>> streams(threads);
+    std::uniform_int_distribution<std::size_t> token(0, tokens - 1);
+    for (auto& stream : streams) {
+        for (std::size_t i = 0; i < swaps; ++i) {
+            std::size_t t_in = token(rng);
+            std::size_t t_out = (t_in + 1 + token(rng) % (tokens - 1)) % tokens;
+            stream.emplace_back(t_in, t_out);
+        }
+    }
+
+    auto run = [&](auto&& swap) {
+        std::vector<std::thread> workers;
+        for (std::size_t w = 0; w < threads; ++w) {
+            workers.emplace_back([&, w] {
+                for (const auto& op : streams[w]) {
+                    swap(names[op.first], names[op.second]);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    };
+
+    InfinityPool coarse = pool;
+    std::mutex coarse_lock;
+    double coarse_ns = bench_ns_per_op(threads * swaps, [&] {
+        run([&](const std::string& t_in, const std::string& t_out) {
+            std::lock_guard<std::mutex> lock(coarse_lock);
+            coarse.swap(t_in, t_out, 1e-6);
+        });
+    });
+
+    StripedPool striped(pool);
+    double striped_ns = bench_ns_per_op(threads * swaps, [&] {
+        run([&](const std::string& t_in, const std::string& t_out) { striped.swap(t_in, t_out, 1e-6); });
+    });
+
+    // the atomic log invariant must agree with a full recomputation
+    double drift = std::abs(striped.get_invariant() / striped.snapshot().get_invariant() - 1.0);
+    std::cout << "striped tokens=" << tokens << " threads=" << threads << " coarse=" << coarse_ns << "ns/swap striped=" << striped_ns
+              << "ns/swap invariant_drift=" << drift << std::endl;
+    return drift < 1e-9 ? 0 : 1;
+}
+
+// pool state without the version, which counts set_invariant() calls and so
+// differs between paths that settle a pool per op and once per block
+static bool bench_same_state(const InfinityPool& a, const InfinityPool& b) {
+    if (a.get_tokens() != b.get_tokens() || a.get_shares_issued() != b.get_shares_issued() || a.get_invariant() != b.get_invariant()) {
+        return false;
+    }
+    for (const auto& token : a.get_tokens()) {
+        if (a.get_balance(token) != b.get_balance(token)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a block of randomly ordered swaps over a fleet: op-order execution vs
+// execute_block(), which must leave identical results and pool state
+static int bench_block(std::size_t fleet, std::size_t count) {
+    std::mt19937_64 rng(97);
+    PoolEngine sequential;
+    bench_fill_engine(sequential, fleet, rng);
+    PoolEngine grouped = sequential;
+    std::vector<SwapOp> ops = bench_swap_ops(fleet, count, rng);
+
+    std::vector<double> expected;
+    std::vector<double> actual;
+    double sequential_ns = bench_ns_per_op(count, [&] { expected = sequential.execute_validated_swaps(ops); });
+    double grouped_ns = bench_ns_per_op(count, [&] { actual = grouped.execute_block(ops); });
+
+    std::size_t mismatches = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        mismatches += !(expected[i] == actual[i] || (std::isnan(expected[i]) && std::isnan(actual[i])));
+    }
+    for (std::size_t id = 0; id < fleet; ++id) {
+        mismatches += !bench_same_state(sequential.pool(id), grouped.pool(id));
+    }
+    std::cout << "block fleet=" << fleet << " ops=" << count << " sequential=" << sequential_ns << "ns/op grouped=" << grouped_ns
+              << "ns/op mismatches=" << mismatches << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+
+// swaps arriving one by one with a tenth dropped before the block: time to
+// produce the block from the pre-executed mempool vs execute_block() on the
+// surviving swaps, which must give identical results and pool state
+static int bench_mempool(std::size_t fleet, std::size_t count) {
+    std::mt19937_64 rng(98);
+    PoolEngine speculative;
+    bench_fill_engine(speculative, fleet, rng);
+    PoolEngine direct = speculative;
+    std::vector<SwapOp> ops = bench_swap_ops(fleet, count, rng);
+
+    Mempool mempool(speculative);
+    std::vector<std::size_t> dropped;
+    std::uniform_int_distribution<std::size_t> pick(0, count - 1);
+    double submit_ns = bench_ns_per_op(count, [&] {
+        for (const auto& op : ops) {
+            mempool.submit(op);
+        }
+        for (std::size_t i = 0; i < count / 10; ++i) {
+            std::size_t id = pick(rng);
+            mempool.drop(id);
+            dropped.push_back(id);
+        }
+    });
+
+    std::vector<unsigned char> live(count, 1);
+    for (std::size_t id : dropped) {
+        live[id] = 0;
+    }
+    std::vector<SwapOp> block;
+    for (std::size_t i = 0; i < count; ++i) {
+        if (live[i]) {
+            block.push_back(ops[i]);
+        }
+    }
+
+    std::vector<double> speculated;
+    std::vector<double> executed;
+    double commit_ns = bench_ns_per_op(block.size(), [&] { speculated = mempool.commit(); });
+    double block_ns = bench_ns_per_op(block.size(), [&] { executed = direct.execute_block(block); });
+
+    std::size_t mismatches = 0;
+    for (std::size_t i = 0, j = 0; i < count; ++i) {
+        if (!live[i]) {
+            mismatches += !std::isnan(speculated[i]);
+            continue;
+        }
+        double a = speculated[i];
+        double b = executed[j++];
+        mismatches += !(a == b || (std::isnan(a) && std::isnan(b)));
+    }
+    for (std::size_t id = 0; id < fleet; ++id) {
+        mismatches += speculative.pool(id).to_bytes() != direct.pool(id).to_bytes();
+    }
+    std::cout << "mempool fleet=" << fleet << " swaps=" << count << " live=" << block.size() << " submit+drop=" << submit_ns
+              << "ns/swap commit=" << commit_ns << "ns/swap execute_block=" << block_ns << "ns/swap mismatches=" << mismatches << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+
+// "which pools hold X and Y" over a fleet where a few hub tokens are in
+// most pools: scanning every token list vs intersecting index bitmaps
+static int bench_index(std::size_t fleet, std::size_t universe, std::size_t queries) {
+    std::mt19937_64 rng(99);
+    std::vector<std::string> names;
+    for (std::size_t t = 0; t < universe; ++t) {
+        names.push_back("T" + std::to_string(t));
+    }
+    // token t is drawn with weight 1 / (t + 1), so T0, T1, ... act as hubs
+    std::vector<double> popularity;
+    for (std::size_t t = 0; t < universe; ++t) {
+        popularity.push_back(1.0 / static_cast<double>(t + 1));
+    }
+    std::discrete_distribution<std::size_t> token(popularity.begin(), popularity.end());
+    std::uniform_int_distribution<std::size_t> width(2, 4);
+
+    PoolEngine engine;
+    for (std::size_t i = 0; i < fleet; ++i) {
+        std::vector<std::string> tokens;
+        for (std::size_t k = width(rng); tokens.size() < k;) {
+            const std::string& name = names[token(rng)];
+            if (std::find(tokens.begin(), tokens.end(), name) == tokens.end()) {
+                tokens.push_back(name);
+            }
+        }
+        engine.add_pool(tokens);
+    }
+
+    std::vector<std::pair<std::size_t, std::size_t>> pairs;
+    for (std::size_t q = 0; q < queries; ++q) {
+        std::size_t a = token(rng);
+        std::size_t b = token(rng);
+        pairs.emplace_back(a, b == a ? (a + 1) % universe : b);
+    }
+
+    const PoolEngine& fleet_view = engine;
+    std::vector<std::vector<std::size_t>> scanned(queries);
+    std::vector<std::vector<std::size_t>> indexed(queries);
+    double scan_ns = bench_ns_per_op(queries, [&] {
+        for (std::size_t q = 0; q < queries; ++q) {
+            for (std::size_t id = 0; id < fleet_view.size(); ++id) {
+                const std::vector<std::string>& tokens = fleet_view.pool(id).get_tokens();
+                if (std::find(tokens.begin(), tokens.end(), names[pairs[q].first]) != tokens.end() &&
+                    std::find(tokens.begin(), tokens.end(), names[pairs[q].second]) != tokens.end()) {
+                    scanned[q].push_back(id);
+                }
+            }
+        }
+    });
+    double index_ns = bench_ns_per_op(queries, [&] {
+        for (std::size_t q = 0; q < queries; ++q) {
+            indexed[q] = engine.token_index().pools_with(names[pairs[q].first], names[pairs[q].second]);
+        }
+    });
+
+    std::size_t mismatches = 0;
+    std::size_t hits = 0;
+    for (std::size_t q = 0; q < queries; ++q) {
+        mismatches += scanned[q] != indexed[q];
+        hits += indexed[q].size();
+    }
+    std::cout << "index fleet=" << fleet << " tokens=" << universe << " hub_pools=" << engine.token_index().pools_with(names[0]).size()
+              << " index_bytes=" << engine.token_index().memory_bytes() << " scan=" << scan_ns / 1000.0 << "us/query index=" << index_ns / 1000.0
+              << "us/query avg_hits=" << static_cast<double>(hits) / static_cast<double>(queries) << " mismatches=" << mismatches << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
+
+// repeated routing requests over a hub-heavy fleet with swaps landing between
+// them: a full search per request vs the route cache, then how many cached
+// answers a fresh search would beat
+static int bench_route(std::size_t fleet, std::size_t universe, std::size_t max_hops, std::size_t requests, std::size_t swap_every) {
+    std::mt19937_64 rng(100);
+    std::vector<std::string> names;
+    std::vector<double> popularity;
+    for (std::size_t t = 0; t < universe; ++t) {
+        names.push_back("T" + std::to_string(t));
+        popularity.push_back(1.0 / static_cast<double>(t + 1));
+    }
+    std::discrete_distribution<std::size_t> token(popularity.begin(), popularity.end());
+    std::uniform_real_distribution<double> balance(1000.0, 10000.0);
+
+    PoolEngine engine;
+    for (std::size_t i = 0; i < fleet; ++i) {
+        std::unordered_map<std::string, double> amount_in;
+        while (amount_in.size() < 2) {
+            amount_in[names[token(rng)]] = balance(rng);
+        }
+        std::vector<std::string> tokens;
+        for (const auto& entry : amount_in) {
+            tokens.push_back(entry.first);
+        }
+        std::size_t id = engine.add_pool(tokens);
+        engine.pool(id).initialize(amount_in);
+        engine.pool(id).set_invariant();
+    }
+
+    // a few popular pairs, sizes spread over three buckets
+    std::vector<std::pair<std::size_t, std::size_t>> pairs;
+    while (pairs.size() < 16) {
+        std::size_t a = token(rng);
+        std::size_t b = token(rng);
+        if (a != b) {
+            pairs.emplace_back(a, b);
+        }
+    }
+    std::uniform_int_distribution<std::size_t> pick_pair(0, pairs.size() - 1);
+    std::uniform_real_distribution<double> size(1.0, 8.0);
+    std::uniform_int_distribution<std::size_t> pick_pool(0, fleet - 1);
+
+    Router router(engine, max_hops);
+    RouteCache cache(router);
+    auto run = [&](bool cached, bool check) {
+        std::mt19937_64 stream(7);
+        std::size_t stale = 0;
+        for (std::size_t r = 0; r < requests; ++r) {
+            if (r % swap_every == 0) {
+                InfinityPool& p = engine.pool(pick_pool(stream));
+                p.swap(p.get_tokens()[0], p.get_tokens()[1], 1e-3);
+            }
+            const auto& pair = pairs[pick_pair(stream)];
+            double amount = size(stream);
+            Route route = cached ? cache.best_route(names[pair.first], names[pair.second], amount)
+                                 : router.best_route(names[pair.first], names[pair.second], amount);
+            if (check && !route.hops.empty()) {
+                stale += router.best_route(names[pair.first], names[pair.second], amount).amount_out > route.amount_out;
+            }
+        }
+        return stale;
+    };
+
+    PoolEngine snapshot = engine;
+    double search_ns = bench_ns_per_op(requests, [&] { run(false, false); });
+    engine = snapshot;
+    double cached_ns = bench_ns_per_op(requests, [&] { run(true, false); });
+    std::size_t hits = cache.hits();
+    engine = snapshot;
+    std::size_t stale = run(true, true);
+
+    std::cout << "route fleet=" << fleet << " tokens=" << universe << " hops=" << max_hops << " search=" << search_ns / 1000.0
+              << "us/request cached=" << cached_ns / 1000.0 << "us/request hit_rate=" << static_cast<double>(hits) / static_cast<double>(requests)
+              << " beaten_by_fresh_search=" << stale << "/" << requests << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    std::string mode = argc > 1 ? argv[1] : "prefetch";
+    if (mode == "prefetch") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 1 << 18;
+        std::size_t count = argc > 3 ? std::stoul(argv[3]) : 1 << 20;
+        return bench_prefetch(fleet, count);
+    }
+    if (mode == "validate") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 1 << 12;
+        std::size_t count = argc > 3 ? std::stoul(argv[3]) : 1 << 20;
+        double spam = argc > 4 ? std::stod(argv[4]) : 0.5;
+        return bench_validate(fleet, count, spam);
+    }
+    if (mode == "footprint") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 100000;
+        std::size_t count = argc > 3 ? std::stoul(argv[3]) : 1000;
+        return bench_footprint(fleet, count);
+    }
+    if (mode == "tiering") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        std::size_t hot = argc > 3 ? std::stoul(argv[3]) : 10000;
+        std::size_t count = argc > 4 ? std::stoul(argv[4]) : 1000000;
+        return bench_tiering(fleet, hot, count);
+    }
+    if (mode == "alloc") {
+        std::size_t calls = argc > 2 ? std::stoul(argv[2]) : 1000;
+        return bench_alloc(calls);
+    }
+    if (mode == "perf") {
+        std::size_t calls = argc > 2 ? std::stoul(argv[2]) : 10000;
+        return bench_perf(calls);
+    }
+    if (mode == "workload") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 10000;
+        std::size_t count = argc > 3 ? std::stoul(argv[3]) : 1000000;
+        double read_ratio = argc > 4 ? std::stod(argv[4]) : 0.5;
+        double zipf = argc > 5 ? std::stod(argv[5]) : 1.1;
+        return bench_workload(fleet, count, read_ratio, zipf);
+    }
+    if (mode == "load") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 10000;
+        std::size_t workers = argc > 3 ? std::stoul(argv[3]) : std::max(1u, std::thread::hardware_concurrency() / 2);
+        std::size_t clients = argc > 4 ? std::stoul(argv[4]) : 4;
+        double seconds = argc > 5 ? std::stod(argv[5]) : 1.0;
+        double max_rate = argc > 6 ? std::stod(argv[6]) : 1e8;
+        return bench_load(fleet, workers, clients, seconds, max_rate);
+    }
+    if (mode == "search") {
+        std::size_t generations = argc > 2 ? std::stoul(argv[2]) : 100;
+        std::size_t population = argc > 3 ? std::stoul(argv[3]) : 16;
+        std::size_t max_tokens = argc > 4 ? std::stoul(argv[4]) : 256;
+        std::uint64_t seed = argc > 5 ? std::stoull(argv[5]) : 84;
+        return bench_search(generations, population, max_tokens, seed);
+    }
+    if (mode == "lp") {
+        std::size_t lps = argc > 2 ? std::stoul(argv[2]) : 10000;
+        std::size_t trades = argc > 3 ? std::stoul(argv[3]) : 1000000;
+        return bench_lp(lps, trades);
+    }
+    if (mode == "risk") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 5000;
+        std::size_t universe = argc > 3 ? std::stoul(argv[3]) : 200;
+        std::size_t scenarios = argc > 4 ? std::stoul(argv[4]) : 10000;
+        std::size_t threads = argc > 5 ? std::stoul(argv[5]) : 0;
+        return bench_risk(fleet, universe, scenarios, threads);
+    }
+    if (mode == "rebalance") {
+        std::size_t tokens = argc > 2 ? std::stoul(argv[2]) : 8;
+        std::size_t pools_per_pair = argc > 3 ? std::stoul(argv[3]) : 3;
+        return bench_rebalance(tokens, pools_per_pair);
+    }
+    if (mode == "sweep") {
+        std::size_t tokens = argc > 2 ? std::stoul(argv[2]) : 3;
+        double step = argc > 3 ? std::stod(argv[3]) : 0.05;
+        std::size_t paths = argc > 4 ? std::stoul(argv[4]) : 256;
+        return bench_sweep(tokens, step, paths);
+    }
+    if (mode == "impact") {
+        std::size_t sizes = argc > 2 ? std::stoul(argv[2]) : 1024;
+        std::size_t rounds = argc > 3 ? std::stoul(argv[3]) : 1000;
+        return bench_impact(sizes, rounds);
+    }
+    if (mode == "flash") {
+        std::size_t tokens = argc > 2 ? std::stoul(argv[2]) : 16;
+        std::size_t hops = argc > 3 ? std::stoul(argv[3]) : 4;
+        std::size_t fleet = argc > 4 ? std::stoul(argv[4]) : 64;
+        std::size_t routes = argc > 5 ? std::stoul(argv[5]) : 100000;
+        return bench_flash(tokens, hops, fleet, routes);
+    }
+    if (mode == "lpdeposit") {
+        std::size_t tokens = argc > 2 ? std::stoul(argv[2]) : 8;
+        std::size_t deposits = argc > 3 ? std::stoul(argv[3]) : 10000;
+        return bench_lp_deposit(tokens, deposits);
+    }
+    if (mode == "lpwithdraw") {
+        std::size_t tokens = argc > 2 ? std::stoul(argv[2]) : 8;
+        std::size_t requests = argc > 3 ? std::stoul(argv[3]) : 10000;
+        return bench_lp_withdraw(tokens, requests);
+    }
+    if (mode == "kernels") {
+        std::size_t quotes = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        return bench_kernels(quotes);
+    }
+    if (mode == "sizeclass") {
+        std::size_t calls = argc > 2 ? std::stoul(argv[2]) : 100000;
+        return bench_size_class(calls);
+    }
+    if (mode == "striped") {
+        std::size_t tokens = argc > 2 ? std::stoul(argv[2]) : 500;
+        std::size_t threads = argc > 3 ? std::stoul(argv[3]) : 4;
+        std::size_t swaps = argc > 4 ? std::stoul(argv[4]) : 20000;
+        return bench_striped(tokens, threads, swaps);
+    }
+    if (mode == "block") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 4096;
+        std::size_t count = argc > 3 ? std::stoul(argv[3]) : 1 << 20;
+        return bench_block(fleet, count);
+    }
+    if (mode == "mempool") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 4096;
+        std::size_t count = argc > 3 ? std::stoul(argv[3]) : 1 << 18;
+        return bench_mempool(fleet, count);
+    }
+    if (mode == "index") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 200000;
+        std::size_t universe = argc > 3 ? std::stoul(argv[3]) : 1000;
+        std::size_t queries = argc > 4 ? std::stoul(argv[4]) : 200;
+        return bench_index(fleet, universe, queries);
+    }
+    if (mode == "route") {
+        std::size_t fleet = argc > 2 ? std::stoul(argv[2]) : 500;
+        std::size_t universe = argc > 3 ? std::stoul(argv[3]) : 100;
+        std::size_t hops = argc > 4 ? std::stoul(argv[4]) : 2;
+        std::size_t requests = argc > 5 ? std::stoul(argv[5]) : 2000;
+        std::size_t swap_every = argc > 6 ? std::stoul(argv[6]) : 10;
+        return bench_route(fleet, universe, hops, requests, swap_every);
+    }
+    std::cerr << "unknown benchmark mode: " << mode << std::endl;
+    return 1;
+}
+
+#else
+
+int main() {
+    std::vector<std::string> tokens = {"X", "Y", "Z"};
+    InfinityPool pool(tokens);
+
+    // Example usage similar to the Python code...
+
+    return 0;
+}
+
+#endif